@@ -1,4 +1,19 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COPY_X86 1
+#include <immintrin.h>
+#else
+#define COPY_X86 0
+#endif
 
 /*
  * Types can be qualified by using one or more of the following qualifiers:
@@ -80,4 +95,547 @@ void copy(int n, int * restrict p, int * restrict q) {
     while (n-- > 0) {
         *p++ = *q++;
     }
+}
+
+/*
+ * The copy loop above moves one int per iteration. Modern CPUs have vector registers
+ * that hold several ints (4 with SSE2, 8 with AVX2, 16 with AVX-512), so the same
+ * loop can move a whole register per load/store pair. Not every CPU supports every
+ * instruction set, so we compile one version per instruction set (the GCC/Clang
+ * target attribute enables the instructions for a single function) and pick the
+ * best one supported by the running CPU at startup, querying CPUID through
+ * __builtin_cpu_supports.
+ *
+ * Aligned stores are faster and never split a cache line, so each version first
+ * copies one unaligned vector (head) and skips ahead to the next address of the
+ * destination aligned to the vector size, then copies whole aligned vectors, and
+ * finally copies the last unaligned vector (tail). Head and tail may overlap ints
+ * already copied, which is harmless since source and destination don't overlap.
+ * Lengths shorter than a vector fall back to the narrower version.
+ */
+
+typedef void (*copy_fn)(size_t n, int * restrict p, const int * restrict q, int stream);
+
+static void copy_scalar(size_t n, int * restrict p, const int * restrict q, int stream) {
+    (void)stream;
+    while (n-- > 0) {
+        *p++ = *q++;
+    }
+}
+
+#if COPY_X86
+
+__attribute__((target("sse2")))
+static void copy_sse2(size_t n, int * restrict p, const int * restrict q, int stream) {
+    if (n < 4) {
+        copy_scalar(n, p, q, stream);
+        return;
+    }
+    // Unaligned head, then skip to the next aligned address.
+    _mm_storeu_si128((__m128i *)p, _mm_loadu_si128((const __m128i *)q));
+    size_t skip = (16 - ((uintptr_t)p & 15)) / sizeof(int);
+    p += skip;
+    q += skip;
+    n -= skip;
+
+    if (stream) {
+        for (; n >= 16; n -= 16, p += 16, q += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)q);
+            __m128i b = _mm_loadu_si128((const __m128i *)q + 1);
+            __m128i c = _mm_loadu_si128((const __m128i *)q + 2);
+            __m128i d = _mm_loadu_si128((const __m128i *)q + 3);
+            _mm_stream_si128((__m128i *)p, a);
+            _mm_stream_si128((__m128i *)p + 1, b);
+            _mm_stream_si128((__m128i *)p + 2, c);
+            _mm_stream_si128((__m128i *)p + 3, d);
+        }
+        _mm_sfence();
+    }
+    for (; n >= 16; n -= 16, p += 16, q += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)q);
+        __m128i b = _mm_loadu_si128((const __m128i *)q + 1);
+        __m128i c = _mm_loadu_si128((const __m128i *)q + 2);
+        __m128i d = _mm_loadu_si128((const __m128i *)q + 3);
+        _mm_store_si128((__m128i *)p, a);
+        _mm_store_si128((__m128i *)p + 1, b);
+        _mm_store_si128((__m128i *)p + 2, c);
+        _mm_store_si128((__m128i *)p + 3, d);
+    }
+    for (; n >= 4; n -= 4, p += 4, q += 4) {
+        _mm_store_si128((__m128i *)p, _mm_loadu_si128((const __m128i *)q));
+    }
+    // Unaligned tail, overlapping ints already copied.
+    if (n > 0) {
+        _mm_storeu_si128((__m128i *)(p + n - 4), _mm_loadu_si128((const __m128i *)(q + n - 4)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(size_t n, int * restrict p, const int * restrict q, int stream) {
+    if (n < 8) {
+        copy_sse2(n, p, q, stream);
+        return;
+    }
+    _mm256_storeu_si256((__m256i *)p, _mm256_loadu_si256((const __m256i *)q));
+    size_t skip = (32 - ((uintptr_t)p & 31)) / sizeof(int);
+    p += skip;
+    q += skip;
+    n -= skip;
+
+    if (stream) {
+        for (; n >= 32; n -= 32, p += 32, q += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)q);
+            __m256i b = _mm256_loadu_si256((const __m256i *)q + 1);
+            __m256i c = _mm256_loadu_si256((const __m256i *)q + 2);
+            __m256i d = _mm256_loadu_si256((const __m256i *)q + 3);
+            _mm256_stream_si256((__m256i *)p, a);
+            _mm256_stream_si256((__m256i *)p + 1, b);
+            _mm256_stream_si256((__m256i *)p + 2, c);
+            _mm256_stream_si256((__m256i *)p + 3, d);
+        }
+        _mm_sfence();
+    }
+    for (; n >= 32; n -= 32, p += 32, q += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)q);
+        __m256i b = _mm256_loadu_si256((const __m256i *)q + 1);
+        __m256i c = _mm256_loadu_si256((const __m256i *)q + 2);
+        __m256i d = _mm256_loadu_si256((const __m256i *)q + 3);
+        _mm256_store_si256((__m256i *)p, a);
+        _mm256_store_si256((__m256i *)p + 1, b);
+        _mm256_store_si256((__m256i *)p + 2, c);
+        _mm256_store_si256((__m256i *)p + 3, d);
+    }
+    for (; n >= 8; n -= 8, p += 8, q += 8) {
+        _mm256_store_si256((__m256i *)p, _mm256_loadu_si256((const __m256i *)q));
+    }
+    if (n > 0) {
+        _mm256_storeu_si256((__m256i *)(p + n - 8), _mm256_loadu_si256((const __m256i *)(q + n - 8)));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(size_t n, int * restrict p, const int * restrict q, int stream) {
+    if (n < 16) {
+        copy_avx2(n, p, q, stream);
+        return;
+    }
+    _mm512_storeu_si512((void *)p, _mm512_loadu_si512((const void *)q));
+    size_t skip = (64 - ((uintptr_t)p & 63)) / sizeof(int);
+    p += skip;
+    q += skip;
+    n -= skip;
+
+    if (stream) {
+        for (; n >= 64; n -= 64, p += 64, q += 64) {
+            __m512i a = _mm512_loadu_si512((const void *)q);
+            __m512i b = _mm512_loadu_si512((const void *)(q + 16));
+            __m512i c = _mm512_loadu_si512((const void *)(q + 32));
+            __m512i d = _mm512_loadu_si512((const void *)(q + 48));
+            _mm512_stream_si512((void *)p, a);
+            _mm512_stream_si512((void *)(p + 16), b);
+            _mm512_stream_si512((void *)(p + 32), c);
+            _mm512_stream_si512((void *)(p + 48), d);
+        }
+        _mm_sfence();
+    }
+    for (; n >= 64; n -= 64, p += 64, q += 64) {
+        __m512i a = _mm512_loadu_si512((const void *)q);
+        __m512i b = _mm512_loadu_si512((const void *)(q + 16));
+        __m512i c = _mm512_loadu_si512((const void *)(q + 32));
+        __m512i d = _mm512_loadu_si512((const void *)(q + 48));
+        _mm512_store_si512((void *)p, a);
+        _mm512_store_si512((void *)(p + 16), b);
+        _mm512_store_si512((void *)(p + 32), c);
+        _mm512_store_si512((void *)(p + 48), d);
+    }
+    for (; n >= 16; n -= 16, p += 16, q += 16) {
+        _mm512_store_si512((void *)p, _mm512_loadu_si512((const void *)q));
+    }
+    if (n > 0) {
+        _mm512_storeu_si512((void *)(p + n - 16), _mm512_loadu_si512((const void *)(q + n - 16)));
+    }
+}
+
+#endif
+
+/*
+ * Normal stores go through the cache: copying a buffer bigger than the last level
+ * cache (LLC) evicts everything else, including the hot working set of the program
+ * (and of other programs on the same socket), only to fill it with data that won't
+ * be read again soon. Non-temporal (streaming) stores write whole cache lines
+ * directly to memory through write-combining buffers, bypassing the cache. They
+ * are weakly ordered, so a store fence (sfence) is needed after the loop to make
+ * them visible to other threads in order with the following stores.
+ *
+ * For small copies streaming stores are slower (the destination is usually read
+ * again right after), so copy_simd only uses them above a threshold, which by
+ * default is half the size of the LLC (a copy touches both source and destination).
+ * The LLC size is read with sysconf on glibc, or from sysfs on Linux.
+ */
+
+#define DEFAULT_LLC_SIZE ((size_t)8 << 20)
+
+static copy_fn copy_impl = copy_scalar;
+static const char *copy_impl_name = "scalar";
+static size_t copy_stream_threshold = SIZE_MAX;
+
+size_t detect_llc_size(void) {
+    long size = -1;
+#if defined(_SC_LEVEL3_CACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+    size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (size <= 0) {
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+#endif
+    // The highest cache index is the last level, sizes are like "2048K".
+    for (int i = 0; size <= 0 && i < 2; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", 3 - i);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        char unit = 'K';
+        if (fscanf(f, "%ld%c", &size, &unit) >= 1) {
+            size *= unit == 'M' ? 1024 * 1024 : 1024;
+        }
+        fclose(f);
+    }
+    return size > 0 ? (size_t)size : DEFAULT_LLC_SIZE;
+}
+
+// Copies of at least bytes bytes use streaming stores,
+// SIZE_MAX disables them.
+void copy_set_stream_threshold(size_t bytes) {
+    copy_stream_threshold = bytes;
+}
+
+// Runs before main, so copy_impl never changes
+// while other threads may be calling copy_simd.
+__attribute__((constructor))
+static void select_copy_impl(void) {
+#if COPY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        copy_impl = copy_avx512;
+        copy_impl_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        copy_impl = copy_avx2;
+        copy_impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        copy_impl = copy_sse2;
+        copy_impl_name = "sse2";
+    }
+    copy_stream_threshold = detect_llc_size() / 2;
+#endif
+}
+
+void copy_simd(size_t n, int * restrict p, const int * restrict q) {
+    copy_impl(n, p, q, n * sizeof(int) >= copy_stream_threshold);
+}
+
+/*
+ * Compare the original loop, memcpy and every version supported by the CPU, for
+ * sizes from 64 bytes up to max_bytes (e.g. 1 GB, the two buffers need twice that).
+ * Each size is repeated so that about 4 GB are moved in total, and the result is
+ * the bandwidth in GB/s. Small sizes fit in L1/L2 and show the per call overhead,
+ * big sizes are bound by the memory bandwidth and all versions converge.
+ */
+
+#define COPY_MAX_BYTES ((size_t)1 << 30)
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void memcpy_ints(size_t n, int * restrict p, const int * restrict q, int stream) {
+    (void)stream;
+    memcpy(p, q, n * sizeof(int));
+}
+
+static void copy_loop(size_t n, int * restrict p, const int * restrict q, int stream) {
+    (void)stream;
+    // The original copy function only takes an int length.
+    copy((int)n, p, (int *)q);
+}
+
+void copy_benchmark(size_t max_bytes) {
+    struct {
+        const char *name;
+        copy_fn fn;
+        int supported;
+    } impls[] = {
+        { "loop", copy_loop, 1 },
+        { "memcpy", memcpy_ints, 1 },
+#if COPY_X86
+        { "sse2", copy_sse2, __builtin_cpu_supports("sse2") },
+        { "avx2", copy_avx2, __builtin_cpu_supports("avx2") },
+        { "avx512", copy_avx512, __builtin_cpu_supports("avx512f") },
+#endif
+    };
+    size_t n_impls = sizeof(impls) / sizeof(impls[0]);
+
+    if (max_bytes > COPY_MAX_BYTES) {
+        max_bytes = COPY_MAX_BYTES;
+    }
+    int *src = malloc(max_bytes);
+    int *dst = malloc(max_bytes);
+    if (src == NULL || dst == NULL) {
+        free(src);
+        free(dst);
+        return;
+    }
+    memset(src, 1, max_bytes);
+    memset(dst, 0, max_bytes);
+
+    printf("dispatched version: %s\n", copy_impl_name);
+    printf("%12s", "bytes");
+    for (size_t i = 0; i < n_impls; i++) {
+        if (impls[i].supported) {
+            printf("%10s", impls[i].name);
+        }
+    }
+    printf("\n");
+
+    for (size_t bytes = 64; bytes <= max_bytes; bytes *= 4) {
+        size_t n = bytes / sizeof(int);
+        size_t reps = ((size_t)4 << 30) / bytes;
+        printf("%12zu", bytes);
+        for (size_t i = 0; i < n_impls; i++) {
+            if (!impls[i].supported) {
+                continue;
+            }
+            impls[i].fn(n, dst, src, 0);
+            double start = now_seconds();
+            for (size_t r = 0; r < reps; r++) {
+                impls[i].fn(n, dst, src, 0);
+            }
+            double secs = now_seconds() - start;
+            printf("%10.2f", (double)bytes * reps / secs / 1e9);
+        }
+        printf("\n");
+    }
+
+    free(src);
+    free(dst);
+}
+
+/*
+ * Measure the effect of streaming stores on a copy four times bigger than the LLC.
+ * A second thread runs a cache sensitive loop, reading one int per cache line of a
+ * working set as big as a quarter of the LLC, and we count how many passes it
+ * completes per second while the main thread copies with normal or streaming
+ * stores. With normal stores the copy keeps evicting the working set, so the loop
+ * slows down. Run it on a machine with at least two idle cores.
+ */
+
+struct hot_loop {
+    const int *data;
+    size_t n;
+    atomic_int stop;
+    size_t passes;
+    long long sum;
+};
+
+static void *hot_loop_run(void *arg) {
+    struct hot_loop *h = arg;
+    while (!atomic_load_explicit(&h->stop, memory_order_relaxed)) {
+        long long sum = 0;
+        for (size_t i = 0; i < h->n; i += 64 / sizeof(int)) {
+            sum += h->data[i];
+        }
+        h->sum += sum;
+        h->passes++;
+    }
+    return NULL;
+}
+
+// Mode -1 runs the hot loop alone, 0 copies with normal
+// stores, 1 copies with streaming stores.
+static void run_with_hot_loop(const int *hot, size_t hot_n, int *dst, const int *src,
+                              size_t n, int mode, double *passes_per_sec, double *gb_per_sec) {
+    struct hot_loop h = { .data = hot, .n = hot_n, .passes = 0, .sum = 0 };
+    atomic_init(&h.stop, 0);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, hot_loop_run, &h) != 0) {
+        perror("creating thread");
+        return;
+    }
+
+    size_t copies = 0;
+    double start = now_seconds();
+    while (now_seconds() - start < 2.0) {
+        if (mode < 0) {
+            usleep(10000);
+        } else {
+            copy_impl(n, dst, src, mode);
+            copies++;
+        }
+    }
+    double secs = now_seconds() - start;
+    atomic_store(&h.stop, 1);
+    pthread_join(thread, NULL);
+
+    *passes_per_sec = h.passes / secs;
+    *gb_per_sec = (double)copies * n * sizeof(int) / secs / 1e9;
+}
+
+void copy_stream_benchmark(void) {
+    size_t llc = detect_llc_size();
+    size_t hot_n = llc / 4 / sizeof(int);
+    size_t n = llc * 4 / sizeof(int);
+    int *hot = malloc(hot_n * sizeof(int));
+    int *src = malloc(n * sizeof(int));
+    int *dst = malloc(n * sizeof(int));
+    if (hot == NULL || src == NULL || dst == NULL) {
+        free(hot);
+        free(src);
+        free(dst);
+        return;
+    }
+    memset(hot, 1, hot_n * sizeof(int));
+    memset(src, 1, n * sizeof(int));
+    memset(dst, 0, n * sizeof(int));
+
+    printf("version: %s, LLC: %zu bytes, default threshold: %zu bytes\n",
+           copy_impl_name, llc, copy_stream_threshold);
+    const char *names[] = { "hot loop alone", "normal stores", "streaming stores" };
+    for (int mode = -1; mode <= 1; mode++) {
+        double passes = 0, gb = 0;
+        run_with_hot_loop(hot, hot_n, dst, src, n, mode, &passes, &gb);
+        printf("%18s: copy %6.2f GB/s, hot loop %8.1f passes/s\n", names[mode + 1], gb, passes);
+    }
+
+    free(hot);
+    free(src);
+    free(dst);
+}
+
+/*
+ * A single core can't saturate the memory bandwidth of a many-core machine, since
+ * each core can only keep a limited number of cache misses in flight. Splitting a
+ * big copy in chunks handled by different threads multiplies the outstanding misses.
+ * Chunk boundaries are aligned to the cache line size (64 bytes on most CPUs),
+ * otherwise two threads would write the same line at the chunk edges (false sharing).
+ *
+ * Creating and joining threads costs some tens of microseconds, so sizes below
+ * PARALLEL_MIN_BYTES per thread use fewer threads, down to the calling thread only.
+ */
+
+#define CACHE_LINE 64
+#define PARALLEL_MAX_THREADS 256
+#define PARALLEL_MIN_BYTES ((size_t)1 << 20)
+
+typedef void (*range_fn)(size_t begin, size_t end, void *arg);
+
+struct range_task {
+    range_fn fn;
+    void *arg;
+    size_t begin;
+    size_t end;
+};
+
+static void *range_task_run(void *arg) {
+    struct range_task *t = arg;
+    t->fn(t->begin, t->end, t->arg);
+    return NULL;
+}
+
+// Call fn on threads byte ranges covering [0, bytes), the range boundaries
+// are chosen so that base + boundary is aligned to a cache line. If threads
+// is 0 all the online CPUs are used. Returns 0 on success, -1 if a thread
+// can't be created (the work is still completed by the calling thread).
+int parallel_ranges(const void *base, size_t bytes, int threads, range_fn fn, void *arg) {
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ((size_t)threads > bytes / PARALLEL_MIN_BYTES) {
+        threads = (int)(bytes / PARALLEL_MIN_BYTES);
+    }
+    if (threads > PARALLEL_MAX_THREADS) {
+        threads = PARALLEL_MAX_THREADS;
+    }
+    if (threads <= 1) {
+        fn(0, bytes, arg);
+        return 0;
+    }
+
+    struct range_task tasks[PARALLEL_MAX_THREADS];
+    pthread_t ids[PARALLEL_MAX_THREADS];
+    size_t misalign = (uintptr_t)base % CACHE_LINE;
+    size_t chunk = (bytes / threads + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    size_t begin = 0;
+    int ret = 0;
+    for (int i = 0; i < threads; i++) {
+        size_t end = (i + 1) * chunk - misalign;
+        if (end > bytes || i == threads - 1) {
+            end = bytes;
+        }
+        tasks[i] = (struct range_task){ .fn = fn, .arg = arg, .begin = begin, .end = end };
+        begin = end;
+    }
+    // The calling thread runs the first range itself.
+    int started = 1;
+    for (; started < threads; started++) {
+        if (pthread_create(&ids[started], NULL, range_task_run, &tasks[started]) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    range_task_run(&tasks[0]);
+    for (int i = started; i < threads; i++) {
+        range_task_run(&tasks[i]);
+    }
+    for (int i = 1; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    return ret;
+}
+
+struct copy_args {
+    int *p;
+    const int *q;
+    int stream;
+};
+
+static void copy_range(size_t begin, size_t end, void *arg) {
+    struct copy_args *a = arg;
+    size_t first = begin / sizeof(int);
+    copy_impl(end / sizeof(int) - first, a->p + first, a->q + first, a->stream);
+}
+
+// Like copy_simd, but split across threads (0 = one per CPU).
+void copy_parallel(size_t n, int * restrict p, const int * restrict q, int threads) {
+    size_t bytes = n * sizeof(int);
+    struct copy_args args = { .p = p, .q = q, .stream = bytes >= copy_stream_threshold };
+    parallel_ranges(p, bytes, threads, copy_range, &args);
+}
+
+// Copy bandwidth of a big buffer (e.g. 1 GB) using 1 up to max_threads threads.
+void copy_parallel_benchmark(size_t bytes, int max_threads) {
+    size_t n = bytes / sizeof(int);
+    int *src = malloc(n * sizeof(int));
+    int *dst = malloc(n * sizeof(int));
+    if (src == NULL || dst == NULL) {
+        free(src);
+        free(dst);
+        return;
+    }
+    memset(src, 1, n * sizeof(int));
+    memset(dst, 0, n * sizeof(int));
+
+    for (int threads = 1; threads <= max_threads; threads++) {
+        copy_parallel(n, dst, src, threads);
+        double start = now_seconds();
+        for (int r = 0; r < 5; r++) {
+            copy_parallel(n, dst, src, threads);
+        }
+        double secs = now_seconds() - start;
+        printf("%3d threads: %6.2f GB/s\n", threads, 5.0 * n * sizeof(int) / secs / 1e9);
+    }
+
+    free(src);
+    free(dst);
 }
\ No newline at end of file
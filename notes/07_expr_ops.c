@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <limits.h>
 #include <stdalign.h>
@@ -56,6 +57,8 @@ void cast_operator(int a) {
  * requirement of the element type.
  */
 
+// To allocate memory with a stricter alignment than the one
+// given by malloc, see aligned_malloc in 12_allocators.c.
 void alignof_operator(void) {
     int arr[4];
     long int arr2[4];
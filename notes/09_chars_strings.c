@@ -2,8 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 
-void print_bits(void *ptr, int len_bytes);
+void print_bits(void *ptr, size_t len_bytes);
+int fprint_bits(FILE *out, const void *ptr, size_t len_bytes);
 
 // CHARS TODO
 
@@ -47,21 +49,136 @@ void string_type(void) {
 
 
 // Utility
-void print_bits(void *ptr, int len_bytes) {
+void print_bits(void *ptr, size_t len_bytes) {
+    fprint_bits(stdout, ptr, len_bytes);
+}
 
-    for (int i = 0; i < len_bytes; i++) {
-        unsigned char byte = *(unsigned char *)(ptr + i);
+/*
+ * Printing one bit at a time with printf is simple but slow: every call has to
+ * parse the format string and lock the stream, so dumping a few KB of memory
+ * costs tens of thousands of stdio calls. Since a byte can only take 256 values,
+ * we can precompute the 8 characters of each one in a lookup table and expand
+ * the input with plain memcpy calls into a buffer on the stack. The buffer is
+ * handed to fwrite once it's full, so a multi-megabyte dump only needs a few
+ * hundred writes and the memory used stays constant.
+ *
+ * Both functions can be called by several threads at once: the table is filled
+ * by a constructor, before main starts any thread, and is only read afterwards,
+ * and each call of fprint_bits has its own buffer.
+ */
+
+#define BITS_BUF_SIZE (16 * 1024)
+
+static char bits_table[256][8];
+
+__attribute__((constructor))
+static void init_bits_table(void) {
+    for (int b = 0; b < 256; b++) {
+        for (int j = 7; j >= 0; j--) {
+            bits_table[b][7 - j] = (b & (1 << j)) == 0 ? '0' : '1';
+        }
+    }
+}
+
+// Expand len bytes into out (8 chars per byte, plus the separator if
+// it's not '\0'). The out buffer must have room for len * 9 chars.
+// Returns the number of chars written.
+size_t format_bits(char *out, const unsigned char *bytes, size_t len, char sep) {
+    char *p = out;
+    for (size_t i = 0; i < len; i++) {
+        memcpy(p, bits_table[bytes[i]], 8);
+        p += 8;
+        if (sep != '\0') {
+            *p++ = sep;
+        }
+    }
+    return p - out;
+}
+
+// Same as format_bits, but expands each byte to two hex digits.
+size_t format_hex(char *out, const unsigned char *bytes, size_t len, char sep) {
+    static const char digits[] = "0123456789abcdef";
+    char *p = out;
+    for (size_t i = 0; i < len; i++) {
+        *p++ = digits[bytes[i] >> 4];
+        *p++ = digits[bytes[i] & 0x0f];
+        if (sep != '\0') {
+            *p++ = sep;
+        }
+    }
+    return p - out;
+}
+
+// Write the bits of len_bytes bytes to the stream, in memory order,
+// one space after each byte and a newline at the end. Returns 0 on
+// success, EOF if a write fails.
+int fprint_bits(FILE *out, const void *ptr, size_t len_bytes) {
+    char buf[BITS_BUF_SIZE];
+    const unsigned char *bytes = ptr;
+    const size_t bytes_per_chunk = BITS_BUF_SIZE / 9;
+
+    while (len_bytes > 0) {
+        size_t n = len_bytes < bytes_per_chunk ? len_bytes : bytes_per_chunk;
+        size_t written = format_bits(buf, bytes, n, ' ');
+        if (fwrite(buf, 1, written, out) != written) {
+            return EOF;
+        }
+        bytes += n;
+        len_bytes -= n;
+    }
+    if (fputc('\n', out) == EOF) {
+        return EOF;
+    }
+    return 0;
+}
+
+/*
+ * Compare the old per-bit printf loop with the table driven version. Both
+ * write to /dev/null so we only measure the formatting and the stdio calls.
+ * For a 4 MB buffer the table driven version is usually some tens of times
+ * faster.
+ */
+
+static void fprint_bits_per_bit(FILE *out, const void *ptr, size_t len_bytes) {
+    for (size_t i = 0; i < len_bytes; i++) {
+        unsigned char byte = ((const unsigned char *)ptr)[i];
         for (int j = 7; j >= 0; j--) {
             unsigned char buf = byte & ((unsigned char)1 << j);
-            printf("%c", buf == 0 ? '0' : '1');
+            fprintf(out, "%c", buf == 0 ? '0' : '1');
         }
-        printf(" ");
+        fprintf(out, " ");
     }
-    printf("\n");
+    fprintf(out, "\n");
 }
 
+void print_bits_benchmark(void) {
+    size_t len = 4 * 1024 * 1024;
+    unsigned char *data = malloc(len);
+    if (data == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (unsigned char)(i * 31);
+    }
 
+    FILE *null = fopen("/dev/null", "w");
+    if (null == NULL) {
+        perror("opening /dev/null");
+        free(data);
+        return;
+    }
 
+    clock_t start = clock();
+    fprint_bits_per_bit(null, data, len);
+    double per_bit = (double)(clock() - start) / CLOCKS_PER_SEC;
 
+    start = clock();
+    fprint_bits(null, data, len);
+    double table = (double)(clock() - start) / CLOCKS_PER_SEC;
 
+    printf("per bit printf: %.3fs, table + fwrite: %.3fs, speedup: %.1fx\n",
+           per_bit, table, table > 0 ? per_bit / table : 0.0);
 
+    fclose(null);
+    free(data);
+}
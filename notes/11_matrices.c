@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Variably modified parameters (see vla_matrix_sum in 08_dyn_alloc.c) let us write
+ * matrix functions that take matrices of any size with the natural m[i][j] syntax.
+ * A matrix allocated on the heap is used through a pointer to a VLA row:
+ *
+ *      float (*a)[cols] = malloc(sizeof(float[rows][cols]));
+ *      a[i][j] = 1.0f;
+ *
+ * The straightforward versions of transpose and multiply are correct but slow on big
+ * matrices, since they read one of the operands column by column: every read touches
+ * a different cache line, which is evicted before its other elements are used. The
+ * kernels below are organized so that the data loaded into the caches (and into the
+ * registers) is reused as much as possible before being evicted.
+ *
+ * C has no templates, so the kernels are written once in a macro and instantiated
+ * for int32_t (accumulating in int64_t, to avoid overflows), float and double.
+ */
+
+/*
+ * A cache-oblivious transpose splits the matrix in two halves along its longest
+ * dimension, recursively, until the block is small enough. At some level of the
+ * recursion the blocks of both the source and the destination fit in each cache
+ * level, whatever the cache sizes are, so every cache line loaded is fully used.
+ */
+
+#define TRANSPOSE_BLOCK 32
+
+/*
+ * The multiply uses two levels of blocking. The k dimension is split in panels of
+ * MATMUL_KC elements, so the panel of b being used stays in the L1/L2 caches. Each
+ * MATMUL_MR x MATMUL_NR tile of c is computed in MR accumulators of NR elements,
+ * declared with the GCC/Clang vector_size attribute: the compiler maps them to as
+ * many SIMD registers as needed by the target (e.g. one AVX-512 register or two AVX
+ * registers per accumulator for floats), so the tile never leaves the registers
+ * during the k loop (register blocking). Each element of a loaded is used NR times
+ * and each row segment of b is used MR times. Multiplying a vector by a scalar
+ * broadcasts the scalar, and __builtin_convertvector widens the int32 elements of b
+ * to the int64 accumulators. The remainders that don't fill a whole tile are
+ * computed with the plain loop.
+ *
+ * The dot products in the matrix-vector multiply use MATVEC_LANES independent
+ * partial sums, since the compiler can't reorder floating point additions by itself
+ * to vectorize a single sum (the result could change).
+ */
+
+#define MATMUL_MR 4
+#define MATMUL_NR 16
+#define MATMUL_KC 256
+#define MATVEC_LANES 8
+
+#define DEFINE_MATRIX_KERNELS(T, ACC, NAME)                                                 \
+                                                                                            \
+typedef T NAME##_vec __attribute__((vector_size(MATMUL_NR * sizeof(T))));                   \
+typedef ACC NAME##_acc_vec __attribute__((vector_size(MATMUL_NR * sizeof(ACC))));           \
+                                                                                            \
+static void transpose_block_##NAME(size_t rows, size_t cols, const T a[rows][cols],         \
+                                   T t[cols][rows], size_t r0, size_t r1,                   \
+                                   size_t c0, size_t c1) {                                  \
+    if (r1 - r0 <= TRANSPOSE_BLOCK && c1 - c0 <= TRANSPOSE_BLOCK) {                         \
+        for (size_t r = r0; r < r1; r++) {                                                  \
+            for (size_t c = c0; c < c1; c++) {                                              \
+                t[c][r] = a[r][c];                                                          \
+            }                                                                               \
+        }                                                                                   \
+    } else if (r1 - r0 >= c1 - c0) {                                                        \
+        size_t mid = r0 + (r1 - r0) / 2;                                                    \
+        transpose_block_##NAME(rows, cols, a, t, r0, mid, c0, c1);                          \
+        transpose_block_##NAME(rows, cols, a, t, mid, r1, c0, c1);                          \
+    } else {                                                                                \
+        size_t mid = c0 + (c1 - c0) / 2;                                                    \
+        transpose_block_##NAME(rows, cols, a, t, r0, r1, c0, mid);                          \
+        transpose_block_##NAME(rows, cols, a, t, r0, r1, mid, c1);                          \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+void transpose_##NAME(size_t rows, size_t cols, const T a[rows][cols], T t[cols][rows]) {   \
+    transpose_block_##NAME(rows, cols, a, t, 0, rows, 0, cols);                             \
+}                                                                                           \
+                                                                                            \
+void matvec_##NAME(size_t rows, size_t cols, const T a[rows][cols],                         \
+                   const T x[cols], ACC y[rows]) {                                          \
+    for (size_t r = 0; r < rows; r++) {                                                     \
+        ACC lanes[MATVEC_LANES] = { 0 };                                                    \
+        size_t c = 0;                                                                       \
+        for (; c + MATVEC_LANES <= cols; c += MATVEC_LANES) {                               \
+            for (size_t l = 0; l < MATVEC_LANES; l++) {                                     \
+                lanes[l] += (ACC)a[r][c + l] * x[c + l];                                    \
+            }                                                                               \
+        }                                                                                   \
+        ACC sum = 0;                                                                        \
+        for (size_t l = 0; l < MATVEC_LANES; l++) {                                         \
+            sum += lanes[l];                                                                \
+        }                                                                                   \
+        for (; c < cols; c++) {                                                             \
+            sum += (ACC)a[r][c] * x[c];                                                     \
+        }                                                                                   \
+        y[r] = sum;                                                                         \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+void matmul_naive_##NAME(size_t n, size_t m, size_t p, const T a[n][m],                     \
+                         const T b[m][p], ACC c[n][p]) {                                    \
+    for (size_t i = 0; i < n; i++) {                                                        \
+        for (size_t j = 0; j < p; j++) {                                                    \
+            ACC sum = 0;                                                                    \
+            for (size_t k = 0; k < m; k++) {                                                \
+                sum += (ACC)a[i][k] * b[k][j];                                              \
+            }                                                                               \
+            c[i][j] = sum;                                                                  \
+        }                                                                                   \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+void matmul_##NAME(size_t n, size_t m, size_t p, const T a[n][m],                           \
+                   const T b[m][p], ACC c[n][p]) {                                          \
+    size_t n_tiles = n - n % MATMUL_MR;                                                     \
+    size_t p_tiles = p - p % MATMUL_NR;                                                     \
+    for (size_t i = 0; i < n; i++) {                                                        \
+        for (size_t j = 0; j < p; j++) {                                                    \
+            c[i][j] = 0;                                                                    \
+        }                                                                                   \
+    }                                                                                       \
+    for (size_t k0 = 0; k0 < m; k0 += MATMUL_KC) {                                          \
+        size_t k1 = k0 + MATMUL_KC < m ? k0 + MATMUL_KC : m;                                \
+        for (size_t i0 = 0; i0 < n_tiles; i0 += MATMUL_MR) {                                \
+            for (size_t j0 = 0; j0 < p_tiles; j0 += MATMUL_NR) {                            \
+                NAME##_acc_vec acc[MATMUL_MR];                                              \
+                for (size_t ii = 0; ii < MATMUL_MR; ii++) {                                 \
+                    memcpy(&acc[ii], &c[i0 + ii][j0], sizeof(acc[ii]));                     \
+                }                                                                           \
+                for (size_t k = k0; k < k1; k++) {                                          \
+                    NAME##_vec bk;                                                          \
+                    memcpy(&bk, &b[k][j0], sizeof(bk));                                     \
+                    NAME##_acc_vec bk_acc = __builtin_convertvector(bk, NAME##_acc_vec);    \
+                    for (size_t ii = 0; ii < MATMUL_MR; ii++) {                             \
+                        acc[ii] += (ACC)a[i0 + ii][k] * bk_acc;                             \
+                    }                                                                       \
+                }                                                                           \
+                for (size_t ii = 0; ii < MATMUL_MR; ii++) {                                 \
+                    memcpy(&c[i0 + ii][j0], &acc[ii], sizeof(acc[ii]));                     \
+                }                                                                           \
+            }                                                                               \
+        }                                                                                   \
+        /* Remainders: last rows (all columns) and last columns (tiled rows). */            \
+        for (size_t i = 0; i < n; i++) {                                                    \
+            size_t j_start = i < n_tiles ? p_tiles : 0;                                     \
+            for (size_t k = k0; k < k1; k++) {                                              \
+                ACC aik = a[i][k];                                                          \
+                for (size_t j = j_start; j < p; j++) {                                      \
+                    c[i][j] += aik * b[k][j];                                               \
+                }                                                                           \
+            }                                                                               \
+        }                                                                                   \
+    }                                                                                       \
+}
+
+DEFINE_MATRIX_KERNELS(int32_t, int64_t, int32)
+DEFINE_MATRIX_KERNELS(float, float, float)
+DEFINE_MATRIX_KERNELS(double, double, double)
+
+/*
+ * Compare the naive triple loop with the blocked kernel on n x n matrices, in
+ * billions of multiply-add operations (counted as 2 operations) per second. Build
+ * with -O3 -march=native to let the compiler use the widest vector registers.
+ */
+
+static double matrix_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCHMARK_MATMUL(T, ACC, NAME, n)                                                   \
+    do {                                                                                    \
+        T (*a)[n] = malloc(sizeof(T[n][n]));                                                \
+        T (*b)[n] = malloc(sizeof(T[n][n]));                                                \
+        ACC (*c)[n] = malloc(sizeof(ACC[n][n]));                                            \
+        ACC (*ref)[n] = malloc(sizeof(ACC[n][n]));                                          \
+        if (a == NULL || b == NULL || c == NULL || ref == NULL) {                           \
+            free(a);                                                                        \
+            free(b);                                                                        \
+            free(c);                                                                        \
+            free(ref);                                                                      \
+            break;                                                                          \
+        }                                                                                   \
+        for (size_t i = 0; i < n; i++) {                                                    \
+            for (size_t j = 0; j < n; j++) {                                                \
+                a[i][j] = (T)((i + j) % 7);                                                 \
+                b[i][j] = (T)((i * j) % 5);                                                 \
+            }                                                                               \
+        }                                                                                   \
+        double ops = 2.0 * n * n * n;                                                       \
+        double start = matrix_seconds();                                                    \
+        matmul_naive_##NAME(n, n, n, a, b, c);                                              \
+        double naive = matrix_seconds() - start;                                            \
+        memcpy(ref, c, sizeof(ACC[n][n]));                                                  \
+        start = matrix_seconds();                                                           \
+        matmul_##NAME(n, n, n, a, b, c);                                                    \
+        double blocked = matrix_seconds() - start;                                          \
+        /* The inputs are small integers, so even the float sums are exact */               \
+        /* and must not depend on the order of the operations. */                           \
+        size_t mismatches = 0;                                                              \
+        for (size_t i = 0; i < n; i++) {                                                    \
+            for (size_t j = 0; j < n; j++) {                                                \
+                mismatches += c[i][j] != ref[i][j];                                         \
+            }                                                                               \
+        }                                                                                   \
+        printf("%8s %5zu: naive %7.2f GFLOP/s, blocked %7.2f GFLOP/s", #NAME, n,            \
+               ops / naive / 1e9, ops / blocked / 1e9);                                     \
+        if (mismatches > 0) {                                                               \
+            printf(" (%zu MISMATCHES)", mismatches);                                        \
+        }                                                                                   \
+        putchar('\n');                                                                      \
+        free(a);                                                                            \
+        free(b);                                                                            \
+        free(c);                                                                            \
+        free(ref);                                                                          \
+    } while (0)
+
+void matrix_benchmark(size_t n) {
+    BENCHMARK_MATMUL(int32_t, int64_t, int32, n);
+    BENCHMARK_MATMUL(float, float, float, n);
+    BENCHMARK_MATMUL(double, double, double, n);
+}
@@ -0,0 +1,1826 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+/*
+ * The general purpose allocator (malloc and friends, see 08_dyn_alloc.c) must handle
+ * any pattern of allocations and deallocations, of any size, from any thread. Each
+ * call has to find a free block of the right size, split or merge blocks, and keep
+ * its bookkeeping consistent between threads. When a program knows more about its
+ * allocations (their lifetime, their size, the thread using them) a custom allocator
+ * built on top of a few big malloc calls can skip most of this work.
+ */
+
+static double alloc_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+///////////////////////// ARENA (REGION) ALLOCATOR /////////////////////////
+
+/*
+ * Many objects share the same lifetime: everything allocated while handling a request
+ * can be released when the request is done. An arena allocates them by incrementing
+ * a pointer into a big block (bump-pointer allocation), rounding it up to the required
+ * alignment, and never frees them one by one: the whole arena is reset at once, which
+ * costs a couple of assignments whatever the number of objects.
+ *
+ * When a block is full, a new one is allocated and chained after it. Blocks are kept
+ * on reset, so an arena used in a loop stops calling malloc after the first rounds.
+ * A mark saves the current position, restoring it releases everything allocated after
+ * the mark, which is handy for temporary allocations in nested scopes.
+ */
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    alignas(max_align_t) unsigned char data[];
+} arena_block;
+
+typedef struct {
+    arena_block *first;
+    arena_block *current;
+    size_t block_size;
+} arena;
+
+typedef struct {
+    arena_block *block;
+    size_t used;
+} arena_mark;
+
+void arena_init(arena *a, size_t block_size) {
+    a->first = NULL;
+    a->current = NULL;
+    a->block_size = block_size == 0 ? ARENA_DEFAULT_BLOCK_SIZE : block_size;
+}
+
+// Insert a new block of at least min_size bytes after the current one.
+static arena_block *arena_new_block(arena *a, size_t min_size) {
+    size_t size = min_size > a->block_size ? min_size : a->block_size;
+    arena_block *b = malloc(sizeof(arena_block) + size);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->size = size;
+    b->used = 0;
+    if (a->current == NULL) {
+        b->next = NULL;
+        a->first = b;
+    } else {
+        b->next = a->current->next;
+        a->current->next = b;
+    }
+    return b;
+}
+
+// Allocate size bytes aligned to align (a power of two). Returns
+// a null pointer if a new block can't be allocated.
+void *arena_alloc(arena *a, size_t size, size_t align) {
+    arena_block *b = a->current;
+    if (b != NULL) {
+        uintptr_t base = (uintptr_t)b->data;
+        size_t offset = ((base + b->used + align - 1) & ~(uintptr_t)(align - 1)) - base;
+        if (offset <= b->size && size <= b->size - offset) {
+            b->used = offset + size;
+            return b->data + offset;
+        }
+        // Reuse the following block (kept by a reset) if it's big enough.
+        if (b->next != NULL && size + align - 1 <= b->next->size) {
+            b = b->next;
+            b->used = 0;
+            a->current = b;
+            return arena_alloc(a, size, align);
+        }
+    }
+    b = arena_new_block(a, size + align - 1);
+    if (b == NULL) {
+        return NULL;
+    }
+    a->current = b;
+    return arena_alloc(a, size, align);
+}
+
+#define ARENA_NEW(a, type) ((type *)arena_alloc((a), sizeof(type), alignof(type)))
+#define ARENA_NEW_ARRAY(a, type, n) ((type *)arena_alloc((a), sizeof(type) * (n), alignof(type)))
+
+arena_mark arena_save(const arena *a) {
+    return (arena_mark){ .block = a->current, .used = a->current == NULL ? 0 : a->current->used };
+}
+
+// Release everything allocated after the mark was saved.
+void arena_restore(arena *a, arena_mark mark) {
+    if (mark.block == NULL) {
+        a->current = a->first;
+        if (a->first != NULL) {
+            a->first->used = 0;
+        }
+        return;
+    }
+    a->current = mark.block;
+    a->current->used = mark.used;
+}
+
+// Release all the objects, keeping the blocks for reuse.
+void arena_reset(arena *a) {
+    arena_restore(a, (arena_mark){ .block = NULL, .used = 0 });
+}
+
+// Release all the objects and the blocks.
+void arena_free(arena *a) {
+    arena_block *b = a->first;
+    while (b != NULL) {
+        arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->first = NULL;
+    a->current = NULL;
+}
+
+/*
+ * Simulate request-scoped work: each request allocates some widgets (the struct used
+ * in 08_dyn_alloc.c) and an array of them, then releases everything. With malloc each
+ * object costs a malloc and a free, with the arena a pointer bump and a final reset.
+ */
+
+typedef struct {
+    char name[10];
+    int quantity;
+} widget;
+
+#define BENCH_REQUESTS 100000
+#define BENCH_OBJECTS 100
+
+void arena_benchmark(void) {
+    widget *objs[BENCH_OBJECTS];
+    long long check = 0;
+
+    double start = alloc_seconds();
+    for (int r = 0; r < BENCH_REQUESTS; r++) {
+        for (int i = 0; i < BENCH_OBJECTS; i++) {
+            objs[i] = malloc(i % 10 == 0 ? sizeof(widget) * 10 : sizeof(widget));
+            if (objs[i] == NULL) {
+                return;
+            }
+            objs[i]->quantity = i;
+        }
+        for (int i = 0; i < BENCH_OBJECTS; i++) {
+            check += objs[i]->quantity;
+            free(objs[i]);
+        }
+    }
+    double with_malloc = alloc_seconds() - start;
+
+    arena a;
+    arena_init(&a, 0);
+    start = alloc_seconds();
+    for (int r = 0; r < BENCH_REQUESTS; r++) {
+        for (int i = 0; i < BENCH_OBJECTS; i++) {
+            objs[i] = i % 10 == 0 ? ARENA_NEW_ARRAY(&a, widget, 10) : ARENA_NEW(&a, widget);
+            if (objs[i] == NULL) {
+                arena_free(&a);
+                return;
+            }
+            objs[i]->quantity = i;
+        }
+        for (int i = 0; i < BENCH_OBJECTS; i++) {
+            check -= objs[i]->quantity;
+        }
+        arena_reset(&a);
+    }
+    double with_arena = alloc_seconds() - start;
+    arena_free(&a);
+
+    printf("malloc/free: %.3fs, arena: %.3fs, speedup: %.1fx%s\n",
+           with_malloc, with_arena, with_malloc / with_arena, check == 0 ? "" : " (MISMATCH)");
+}
+
+///////////////////////// FIXED-SIZE OBJECT POOL /////////////////////////
+
+/*
+ * When a program allocates and frees lots of objects of the same type, a pool can
+ * hand them out in constant time. A free object isn't in use, so its own memory can
+ * store the pointer to the next free object (an intrusive free list): allocating pops
+ * the head of the list, freeing pushes the object back. When the list is empty, a
+ * whole slab of objects is allocated with one malloc and threaded into the list.
+ *
+ * A single free list shared by all the threads needs a lock, which becomes the
+ * bottleneck. So each thread keeps a magazine, a small private free list of up to
+ * POOL_MAGAZINE_SIZE objects stored with pthread thread-specific data: most
+ * allocations and frees only touch the magazine, and the lock is taken only to move
+ * half a magazine of objects from or to the shared list. When a thread exits, its
+ * magazine is given back to the shared list.
+ *
+ * The pool must be destroyed only after all the other threads that used it have
+ * exited, since their magazines point to it.
+ */
+
+#define POOL_MAGAZINE_SIZE 64
+#define POOL_DEFAULT_SLAB_OBJECTS 1024
+
+typedef union pool_node {
+    union pool_node *next;
+    max_align_t align;
+} pool_node;
+
+typedef struct pool_slab {
+    struct pool_slab *next;
+    alignas(max_align_t) unsigned char data[];
+} pool_slab;
+
+typedef struct pool_magazine {
+    struct pool_magazine *next;
+    struct pool *pool;
+    pool_node *items;
+    atomic_size_t count;
+} pool_magazine;
+
+typedef struct pool {
+    size_t obj_size;
+    size_t slab_objects;
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    // Protected by lock.
+    pool_node *free_list;
+    size_t free_count;
+    pool_slab *slabs;
+    pool_magazine *magazines;
+    size_t total;
+    size_t peak_taken;
+} pool;
+
+typedef struct {
+    size_t live;        // objects handed out to the program
+    size_t free;        // objects in the shared list and in the magazines
+    // Peak of the objects taken from the shared list, live or parked in a magazine:
+    // an upper bound of the peak of live objects, whose exact value would need a
+    // counter shared by all the threads, updated by every alloc and free.
+    size_t peak_taken;
+    size_t total;       // objects in all the slabs
+} pool_stats;
+
+// Move objects from the magazine back to the shared list, until only
+// keep objects remain in the magazine. Must be called with the lock held.
+static void pool_drain(pool *p, pool_magazine *m, size_t keep) {
+    size_t count = atomic_load_explicit(&m->count, memory_order_relaxed);
+    while (count > keep) {
+        pool_node *n = m->items;
+        m->items = n->next;
+        n->next = p->free_list;
+        p->free_list = n;
+        p->free_count++;
+        count--;
+    }
+    atomic_store_explicit(&m->count, count, memory_order_relaxed);
+}
+
+static void pool_magazine_release(void *arg) {
+    pool_magazine *m = arg;
+    pool *p = m->pool;
+    pthread_mutex_lock(&p->lock);
+    pool_drain(p, m, 0);
+    for (pool_magazine **it = &p->magazines; *it != NULL; it = &(*it)->next) {
+        if (*it == m) {
+            *it = m->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(m);
+}
+
+// Objects are at least as big as a pointer (to be linked in the free
+// list) and keep the alignment of max_align_t.
+int pool_init(pool *p, size_t obj_size, size_t slab_objects) {
+    p->obj_size = (obj_size + sizeof(pool_node) - 1) / sizeof(pool_node) * sizeof(pool_node);
+    p->slab_objects = slab_objects == 0 ? POOL_DEFAULT_SLAB_OBJECTS : slab_objects;
+    p->free_list = NULL;
+    p->free_count = 0;
+    p->slabs = NULL;
+    p->magazines = NULL;
+    p->total = 0;
+    p->peak_taken = 0;
+    if (pthread_key_create(&p->key, pool_magazine_release) != 0) {
+        return -1;
+    }
+    if (pthread_mutex_init(&p->lock, NULL) != 0) {
+        pthread_key_delete(p->key);
+        return -1;
+    }
+    return 0;
+}
+
+// Allocate a new slab and add its objects to the shared list.
+// Must be called with the lock held.
+static int pool_refill(pool *p) {
+    pool_slab *slab = malloc(sizeof(pool_slab) + p->obj_size * p->slab_objects);
+    if (slab == NULL) {
+        return -1;
+    }
+    slab->next = p->slabs;
+    p->slabs = slab;
+    for (size_t i = 0; i < p->slab_objects; i++) {
+        pool_node *n = (pool_node *)(slab->data + i * p->obj_size);
+        n->next = p->free_list;
+        p->free_list = n;
+    }
+    p->free_count += p->slab_objects;
+    p->total += p->slab_objects;
+    return 0;
+}
+
+static pool_magazine *pool_magazine_get(pool *p) {
+    pool_magazine *m = pthread_getspecific(p->key);
+    if (m != NULL) {
+        return m;
+    }
+    m = malloc(sizeof(pool_magazine));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->pool = p;
+    m->items = NULL;
+    atomic_init(&m->count, 0);
+    if (pthread_setspecific(p->key, m) != 0) {
+        free(m);
+        return NULL;
+    }
+    pthread_mutex_lock(&p->lock);
+    m->next = p->magazines;
+    p->magazines = m;
+    pthread_mutex_unlock(&p->lock);
+    return m;
+}
+
+void *pool_alloc(pool *p) {
+    pool_magazine *m = pool_magazine_get(p);
+    if (m == NULL) {
+        return NULL;
+    }
+    size_t count = atomic_load_explicit(&m->count, memory_order_relaxed);
+    if (count == 0) {
+        // Take half a magazine from the shared list.
+        pthread_mutex_lock(&p->lock);
+        while (count < POOL_MAGAZINE_SIZE / 2) {
+            if (p->free_list == NULL && pool_refill(p) == -1) {
+                break;
+            }
+            pool_node *n = p->free_list;
+            p->free_list = n->next;
+            p->free_count--;
+            n->next = m->items;
+            m->items = n;
+            count++;
+        }
+        if (p->total - p->free_count > p->peak_taken) {
+            p->peak_taken = p->total - p->free_count;
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (count == 0) {
+            return NULL;
+        }
+    }
+    pool_node *n = m->items;
+    m->items = n->next;
+    atomic_store_explicit(&m->count, count - 1, memory_order_relaxed);
+    return n;
+}
+
+void pool_free(pool *p, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    pool_magazine *m = pool_magazine_get(p);
+    pool_node *n = obj;
+    if (m == NULL) {
+        pthread_mutex_lock(&p->lock);
+        n->next = p->free_list;
+        p->free_list = n;
+        p->free_count++;
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    n->next = m->items;
+    m->items = n;
+    size_t count = atomic_load_explicit(&m->count, memory_order_relaxed) + 1;
+    atomic_store_explicit(&m->count, count, memory_order_relaxed);
+    if (count >= POOL_MAGAZINE_SIZE) {
+        pthread_mutex_lock(&p->lock);
+        pool_drain(p, m, POOL_MAGAZINE_SIZE / 2);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+#define POOL_NEW(p, type) ((type *)pool_alloc(p))
+
+// The counts of the magazines are read without stopping the other
+// threads, so the stats are a snapshot that may be slightly stale.
+pool_stats pool_get_stats(pool *p) {
+    pthread_mutex_lock(&p->lock);
+    size_t free = p->free_count;
+    for (pool_magazine *m = p->magazines; m != NULL; m = m->next) {
+        free += atomic_load_explicit(&m->count, memory_order_relaxed);
+    }
+    pool_stats stats = {
+        .live = p->total - free,
+        .free = free,
+        .peak_taken = p->peak_taken,
+        .total = p->total,
+    };
+    pthread_mutex_unlock(&p->lock);
+    return stats;
+}
+
+void pool_destroy(pool *p) {
+    pool_magazine *m = pthread_getspecific(p->key);
+    if (m != NULL) {
+        pthread_setspecific(p->key, NULL);
+        pool_magazine_release(m);
+    }
+    pthread_key_delete(p->key);
+    pthread_mutex_destroy(&p->lock);
+    pool_slab *slab = p->slabs;
+    while (slab != NULL) {
+        pool_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    p->slabs = NULL;
+}
+
+/*
+ * Each thread repeatedly allocates a batch of widgets and frees them, the usual churn
+ * of a service handling requests, first with malloc/free and then with the pool.
+ */
+
+#define CHURN_THREADS 4
+#define CHURN_ROUNDS 200000
+#define CHURN_BATCH 32
+
+static pool churn_pool;
+
+static void *churn_malloc(void *arg) {
+    (void)arg;
+    widget *objs[CHURN_BATCH];
+    for (int r = 0; r < CHURN_ROUNDS; r++) {
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            objs[i] = malloc(sizeof(widget));
+            if (objs[i] != NULL) {
+                objs[i]->quantity = i;
+            }
+        }
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            free(objs[i]);
+        }
+    }
+    return NULL;
+}
+
+static void *churn_pool_run(void *arg) {
+    (void)arg;
+    widget *objs[CHURN_BATCH];
+    for (int r = 0; r < CHURN_ROUNDS; r++) {
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            objs[i] = POOL_NEW(&churn_pool, widget);
+            if (objs[i] != NULL) {
+                objs[i]->quantity = i;
+            }
+        }
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            pool_free(&churn_pool, objs[i]);
+        }
+    }
+    return NULL;
+}
+
+static double churn(void *(*run)(void *)) {
+    pthread_t threads[CHURN_THREADS];
+    double start = alloc_seconds();
+    int started = 0;
+    for (; started < CHURN_THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, run, NULL) != 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return alloc_seconds() - start;
+}
+
+void pool_benchmark(void) {
+    if (pool_init(&churn_pool, sizeof(widget), 0) == -1) {
+        return;
+    }
+    double with_malloc = churn(churn_malloc);
+    double with_pool = churn(churn_pool_run);
+
+    pool_stats stats = pool_get_stats(&churn_pool);
+    printf("%d threads, malloc/free: %.3fs, pool: %.3fs, speedup: %.1fx\n",
+           CHURN_THREADS, with_malloc, with_pool, with_malloc / with_pool);
+    printf("pool: %zu live, %zu free, %zu peak taken, %zu total\n",
+           stats.live, stats.free, stats.peak_taken, stats.total);
+    pool_destroy(&churn_pool);
+}
+
+///////////////////////// SIZE-CLASS SLAB ALLOCATOR /////////////////////////
+
+/*
+ * Structures with a flexible array member (like tool in 08_dyn_alloc.c) have a
+ * different size for every object. Mixing millions of them of widely different sizes
+ * in the general purpose heap fragments it: the holes left by freed objects rarely
+ * fit the next request exactly.
+ *
+ * A slab allocator rounds each size up to one of a few size classes (four per power
+ * of two, so at most 25% of each slot is wasted) and gives each class its own slabs:
+ * 64 KB blocks cut in slots of the same size, with an intrusive free list of the
+ * free slots. Allocating and freeing are a pop and a push on the free list of the
+ * class, and objects of the same class are packed densely in the same slabs.
+ *
+ * Slabs are allocated aligned to their size, so the slab containing an object (and
+ * its header, with the class of the object) is found by clearing the low bits of
+ * the object address. Objects bigger than the largest class get a block of their own
+ * with the same header. Growing an object that still fits in its slot doesn't move
+ * it: only bigger sizes are moved (and copied) to a larger class.
+ *
+ * The allocator isn't thread-safe, each thread should use its own.
+ */
+
+#define SLAB_SIZE ((size_t)64 * 1024)
+#define SLAB_HEADER_SIZE 64
+#define SLAB_LARGE_CLASS SIZE_MAX
+
+static const size_t slab_class_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+};
+
+#define SLAB_CLASSES (sizeof(slab_class_sizes) / sizeof(slab_class_sizes[0]))
+#define SLAB_MAX_SIZE 4096
+
+typedef struct slab_header {
+    struct slab_header *next;
+    size_t class_index;
+    size_t size;      // size of the object, for the large ones
+    size_t used;      // slots in use
+} slab_header;
+
+typedef struct {
+    pool_node *free_list;
+    slab_header *slabs;
+    size_t slab_count;
+    size_t used;
+} slab_class;
+
+typedef struct {
+    slab_class classes[SLAB_CLASSES];
+    // Class of each size, in steps of 16 bytes, so
+    // finding the class costs a single lookup.
+    unsigned char class_of[SLAB_MAX_SIZE / 16 + 1];
+    size_t large_count;
+} slab_allocator;
+
+void slab_allocator_init(slab_allocator *s) {
+    size_t c = 0;
+    for (size_t i = 0; i <= SLAB_MAX_SIZE / 16; i++) {
+        while (slab_class_sizes[c] < i * 16) {
+            c++;
+        }
+        s->class_of[i] = (unsigned char)c;
+    }
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        s->classes[i] = (slab_class){ .free_list = NULL, .slabs = NULL, .slab_count = 0, .used = 0 };
+    }
+    s->large_count = 0;
+}
+
+static slab_header *slab_of(void *ptr) {
+    return (slab_header *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static int slab_add(slab_class *cls, size_t class_index) {
+    slab_header *slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (slab == NULL) {
+        return -1;
+    }
+    slab->class_index = class_index;
+    slab->size = 0;
+    slab->used = 0;
+    slab->next = cls->slabs;
+    cls->slabs = slab;
+    cls->slab_count++;
+
+    size_t slot = slab_class_sizes[class_index];
+    unsigned char *data = (unsigned char *)slab + SLAB_HEADER_SIZE;
+    size_t slots = (SLAB_SIZE - SLAB_HEADER_SIZE) / slot;
+    for (size_t i = slots; i-- > 0;) {
+        pool_node *n = (pool_node *)(data + i * slot);
+        n->next = cls->free_list;
+        cls->free_list = n;
+    }
+    return 0;
+}
+
+void *slab_alloc(slab_allocator *s, size_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        // A block of its own, rounded up to a multiple of its alignment.
+        size_t total = (SLAB_HEADER_SIZE + size + SLAB_SIZE - 1) / SLAB_SIZE * SLAB_SIZE;
+        slab_header *block = aligned_alloc(SLAB_SIZE, total);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->class_index = SLAB_LARGE_CLASS;
+        block->size = size;
+        block->used = 1;
+        block->next = NULL;
+        s->large_count++;
+        return (unsigned char *)block + SLAB_HEADER_SIZE;
+    }
+
+    size_t class_index = s->class_of[(size + 15) / 16];
+    slab_class *cls = &s->classes[class_index];
+    if (cls->free_list == NULL && slab_add(cls, class_index) == -1) {
+        return NULL;
+    }
+    pool_node *n = cls->free_list;
+    cls->free_list = n->next;
+    cls->used++;
+    slab_of(n)->used++;
+    return n;
+}
+
+void slab_free(slab_allocator *s, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    slab_header *slab = slab_of(ptr);
+    if (slab->class_index == SLAB_LARGE_CLASS) {
+        s->large_count--;
+        free(slab);
+        return;
+    }
+    slab_class *cls = &s->classes[slab->class_index];
+    pool_node *n = ptr;
+    n->next = cls->free_list;
+    cls->free_list = n;
+    cls->used--;
+    slab->used--;
+}
+
+// Like realloc: the object stays in place if the new size fits in its slot,
+// otherwise it's moved to a larger class. On failure the old object is left
+// untouched and a null pointer is returned.
+void *slab_realloc(slab_allocator *s, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return slab_alloc(s, size);
+    }
+    slab_header *slab = slab_of(ptr);
+    size_t capacity = slab->class_index == SLAB_LARGE_CLASS
+                      ? slab->size
+                      : slab_class_sizes[slab->class_index];
+    if (size <= capacity) {
+        return ptr;
+    }
+    void *moved = slab_alloc(s, size);
+    if (moved == NULL) {
+        return NULL;
+    }
+    memcpy(moved, ptr, capacity);
+    slab_free(s, ptr);
+    return moved;
+}
+
+void slab_print_occupancy(const slab_allocator *s, FILE *out) {
+    fprintf(out, "%6s %8s %10s %10s %9s\n", "class", "slabs", "used", "capacity", "occupancy");
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        const slab_class *cls = &s->classes[i];
+        if (cls->slab_count == 0) {
+            continue;
+        }
+        size_t capacity = cls->slab_count * ((SLAB_SIZE - SLAB_HEADER_SIZE) / slab_class_sizes[i]);
+        fprintf(out, "%6zu %8zu %10zu %10zu %8.1f%%\n", slab_class_sizes[i], cls->slab_count,
+                cls->used, capacity, 100.0 * cls->used / capacity);
+    }
+    fprintf(out, "%6s %8zu\n", "large", s->large_count);
+}
+
+void slab_allocator_destroy(slab_allocator *s) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        slab_header *slab = s->classes[i].slabs;
+        while (slab != NULL) {
+            slab_header *next = slab->next;
+            free(slab);
+            slab = next;
+        }
+        s->classes[i] = (slab_class){ .free_list = NULL, .slabs = NULL, .slab_count = 0, .used = 0 };
+    }
+    // Large objects must be freed by the program.
+}
+
+/*
+ * Typed helpers for the tool structure with a flexible array member.
+ */
+
+typedef struct {
+    int num;
+    int data[];
+} tool;
+
+tool *tool_new(slab_allocator *s, int array_size) {
+    tool *t = slab_alloc(s, sizeof(tool) + sizeof(int) * array_size);
+    if (t != NULL) {
+        t->num = array_size;
+    }
+    return t;
+}
+
+tool *tool_resize(slab_allocator *s, tool *t, int array_size) {
+    tool *resized = slab_realloc(s, t, sizeof(tool) + sizeof(int) * array_size);
+    if (resized != NULL) {
+        resized->num = array_size;
+    }
+    return resized;
+}
+
+void tool_delete(slab_allocator *s, tool *t) {
+    slab_free(s, t);
+}
+
+void slab_usage(void) {
+    slab_allocator s;
+    slab_allocator_init(&s);
+
+    tool *tools[1000];
+    for (int i = 0; i < 1000; i++) {
+        tools[i] = tool_new(&s, i % 100);
+    }
+    // 2 ints fit in the 16 bytes slot of tool_new(&s, 1).
+    tool *grown = tool_resize(&s, tools[1], 2);
+    printf("grown in place: %s\n", grown == tools[1] ? "yes" : "no");
+    if (grown != NULL) {
+        tools[1] = grown;
+    }
+
+    slab_print_occupancy(&s, stdout);
+    for (int i = 0; i < 1000; i++) {
+        tool_delete(&s, tools[i]);
+    }
+    slab_allocator_destroy(&s);
+}
+
+///////////////////////// GROWABLE ARRAYS /////////////////////////
+
+/*
+ * Growing an array one element at a time with realloc (like realloc_func in
+ * 08_dyn_alloc.c, but in a loop) may copy the whole array at every step, so
+ * appending n elements costs O(n^2) in the worst case. A growable array (vector)
+ * keeps a capacity larger than its length and multiplies it by a constant factor
+ * when it's full: the total work of the copies is a geometric series bounded by
+ * n * factor / (factor - 1), so each append costs O(1) amortized. A factor of 2
+ * wastes up to half the memory, 1.5 wastes less but copies more often.
+ *
+ * Shrinking has the opposite problem: shrinking as soon as the length drops below
+ * the capacity would reallocate at every push/pop around the boundary. The pop
+ * function halves the capacity only when the length drops below a quarter of it
+ * (hysteresis), while shrink_to_fit releases all the unused capacity on request.
+ *
+ * If realloc fails the old array is still valid, so the functions return -1 and
+ * leave the vector untouched. The vector is instantiated per element type with a
+ * macro, like the kernels in 11_matrices.c.
+ */
+
+#define VECTOR_DEFAULT_GROWTH 2.0
+#define VECTOR_MIN_CAPACITY 8
+
+#define DEFINE_VECTOR(T, NAME)                                                              \
+                                                                                            \
+typedef struct {                                                                            \
+    T *data;                                                                                \
+    size_t len;                                                                             \
+    size_t cap;                                                                             \
+    double growth;                                                                          \
+} NAME;                                                                                     \
+                                                                                            \
+void NAME##_init(NAME *v, double growth) {                                                  \
+    v->data = NULL;                                                                         \
+    v->len = 0;                                                                             \
+    v->cap = 0;                                                                             \
+    v->growth = growth > 1.0 ? growth : VECTOR_DEFAULT_GROWTH;                              \
+}                                                                                           \
+                                                                                            \
+static int NAME##_set_capacity(NAME *v, size_t cap) {                                       \
+    if (cap > SIZE_MAX / sizeof(T)) {                                                       \
+        return -1;                                                                          \
+    }                                                                                       \
+    /* realloc(p, 0) may return NULL or not, and is deprecated since C23. */                \
+    if (cap == 0) {                                                                         \
+        free(v->data);                                                                      \
+        v->data = NULL;                                                                     \
+        v->cap = 0;                                                                         \
+        return 0;                                                                           \
+    }                                                                                       \
+    T *data = realloc(v->data, cap * sizeof(T));                                            \
+    if (data == NULL) {                                                                     \
+        return -1;                                                                          \
+    }                                                                                       \
+    v->data = data;                                                                         \
+    v->cap = cap;                                                                           \
+    return 0;                                                                               \
+}                                                                                           \
+                                                                                            \
+/* Make room for at least cap elements. */                                                  \
+int NAME##_reserve(NAME *v, size_t cap) {                                                   \
+    return cap <= v->cap ? 0 : NAME##_set_capacity(v, cap);                                 \
+}                                                                                           \
+                                                                                            \
+/* Make room for extra more elements, growing geometrically. */                             \
+static int NAME##_grow(NAME *v, size_t extra) {                                             \
+    if (extra > SIZE_MAX / sizeof(T) - v->len) {                                            \
+        return -1;                                                                          \
+    }                                                                                       \
+    size_t needed = v->len + extra;                                                         \
+    if (needed <= v->cap) {                                                                 \
+        return 0;                                                                           \
+    }                                                                                       \
+    double grown = v->cap * v->growth;                                                      \
+    size_t cap = grown < (double)(SIZE_MAX / sizeof(T)) ? (size_t)grown : SIZE_MAX / sizeof(T); \
+    if (cap < VECTOR_MIN_CAPACITY) {                                                        \
+        cap = VECTOR_MIN_CAPACITY;                                                          \
+    }                                                                                       \
+    if (cap < needed) {                                                                     \
+        cap = needed;                                                                       \
+    }                                                                                       \
+    return NAME##_set_capacity(v, cap);                                                     \
+}                                                                                           \
+                                                                                            \
+int NAME##_push(NAME *v, T value) {                                                         \
+    if (v->len == v->cap && NAME##_grow(v, 1) == -1) {                                      \
+        return -1;                                                                          \
+    }                                                                                       \
+    v->data[v->len++] = value;                                                              \
+    return 0;                                                                               \
+}                                                                                           \
+                                                                                            \
+int NAME##_append(NAME *v, const T *values, size_t n) {                                     \
+    if (n == 0) {                                                                           \
+        return 0;                                                                           \
+    }                                                                                       \
+    if (NAME##_grow(v, n) == -1) {                                                          \
+        return -1;                                                                          \
+    }                                                                                       \
+    memcpy(v->data + v->len, values, n * sizeof(T));                                        \
+    v->len += n;                                                                            \
+    return 0;                                                                               \
+}                                                                                           \
+                                                                                            \
+/* Remove the last element into *out, the vector must not be empty. */                      \
+void NAME##_pop(NAME *v, T *out) {                                                          \
+    *out = v->data[--v->len];                                                               \
+    if (v->cap > VECTOR_MIN_CAPACITY && v->len < v->cap / 4) {                              \
+        /* Shrinking can't fail in practice, if it does keep the memory. */                 \
+        NAME##_set_capacity(v, v->cap / 2);                                                 \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+int NAME##_shrink_to_fit(NAME *v) {                                                         \
+    return v->len == v->cap ? 0 : NAME##_set_capacity(v, v->len);                           \
+}                                                                                           \
+                                                                                            \
+void NAME##_free(NAME *v) {                                                                 \
+    free(v->data);                                                                          \
+    v->data = NULL;                                                                         \
+    v->len = 0;                                                                             \
+    v->cap = 0;                                                                             \
+}
+
+DEFINE_VECTOR(int, int_vector)
+DEFINE_VECTOR(widget, widget_vector)
+
+/*
+ * Append n ints (e.g. 10^8) one at a time with realloc growing the array by one
+ * element per call, then with the vector. On glibc big blocks are mapped with mmap
+ * and grown in place with mremap, so the naive loop avoids the quadratic copies,
+ * but it still pays a realloc call for every element.
+ */
+
+void vector_benchmark(size_t n) {
+    double start = alloc_seconds();
+    int *naive = NULL;
+    for (size_t i = 0; i < n; i++) {
+        int *grown = realloc(naive, (i + 1) * sizeof(int));
+        if (grown == NULL) {
+            free(naive);
+            return;
+        }
+        naive = grown;
+        naive[i] = (int)i;
+    }
+    double with_realloc = alloc_seconds() - start;
+    free(naive);
+
+    int_vector v;
+    int_vector_init(&v, 0);
+    start = alloc_seconds();
+    for (size_t i = 0; i < n; i++) {
+        if (int_vector_push(&v, (int)i) == -1) {
+            int_vector_free(&v);
+            return;
+        }
+    }
+    double with_vector = alloc_seconds() - start;
+    int_vector_free(&v);
+
+    printf("%zu elements, realloc by one: %.3fs (%.1f ns/op), vector: %.3fs (%.1f ns/op)\n",
+           n, with_realloc, with_realloc * 1e9 / n, with_vector, with_vector * 1e9 / n);
+}
+
+///////////////////////// ALLOCATION PROFILER /////////////////////////
+
+/*
+ * To find the allocation hot spots of a program we can wrap the allocation functions:
+ * compiling 08_dyn_alloc.c (or any file that declares the same macros) with
+ * -DALLOC_PROFILE replaces the calls to malloc, calloc, realloc and free with a test
+ * of alloc_profile_enabled, which calls the profile_ functions below only while
+ * profiling is enabled, passing the call site given by the __FILE__ and __LINE__
+ * macros. A macro is not expanded again inside its own definition, so the other
+ * branch calls the real allocator: with profiling disabled the cost is one load and
+ * one well predicted branch per call. In a loop that does nothing but malloc and
+ * free, alloc_profile_benchmark measures no difference above the noise with -O2
+ * (about 12 ns per pair either way), and about 1 ns (5-10%) without optimizations,
+ * where the load of the flag is not kept in a register.
+ *
+ * The blocks are not changed: their size and allocation time, needed by free to
+ * compute the lifetime, are kept in a side table indexed by address, filled only
+ * while enabled. The table is a fixed array with open addressing where a slot is
+ * taken and released with a compare-and-swap on its address, so threads can free
+ * blocks allocated by others without a lock. A block is looked for in at most
+ * PROFILE_PROBES slots, so a block that finds them all taken is only counted (as
+ * untracked) and never slows down the others. Blocks allocated while disabled are
+ * not in the table: their free is counted at its call site, but has no lifetime.
+ *
+ * The other events are recorded in a buffer owned by the calling thread, so threads
+ * never wait for each other: the buffers are allocated on the first event of each
+ * thread and pushed on a global list with a compare-and-swap. Only the live and peak
+ * byte counters are shared atomics. The report, sorted by number of allocations and
+ * frees, is printed at exit (threads still running at exit may miss a few events).
+ */
+
+#define PROFILE_SITES 512
+#define PROFILE_BUCKETS 64
+#define PROFILE_TOP_SITES 20
+#define PROFILE_BLOCKS_LOG2 18
+#define PROFILE_PROBES 64
+#define PROFILE_REMOVED ((uintptr_t)1)
+
+// Only what free needs, the call site is counted when the block is allocated.
+typedef struct {
+    _Atomic uintptr_t ptr;  // 0 if never used, PROFILE_REMOVED after a free
+    size_t size;
+    uint64_t time_ns;
+} profile_block;
+
+typedef struct {
+    const char *file;
+    int line;
+    size_t allocs;
+    size_t frees;
+    size_t bytes;
+} profile_site;
+
+typedef struct profile_buffer {
+    struct profile_buffer *next;
+    profile_site sites[PROFILE_SITES];
+    size_t other_allocs;
+    size_t other_frees;
+    size_t untracked;
+    size_t sizes[PROFILE_BUCKETS];      // by log2 of the size
+    size_t lifetimes[PROFILE_BUCKETS];  // by log2 of the lifetime in ns
+} profile_buffer;
+
+// Not static: the macros of the profiled files test it before calling us.
+atomic_int alloc_profile_enabled = 0;
+
+static profile_block profile_blocks[1 << PROFILE_BLOCKS_LOG2];
+static _Atomic(profile_buffer *) profile_buffers = NULL;
+static _Atomic long long profile_live = 0;
+static _Atomic long long profile_peak = 0;
+static _Thread_local profile_buffer *profile_local = NULL;
+
+static uint64_t profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int profile_log2(uint64_t x) {
+    int bucket = 0;
+    while (x > 1 && bucket < PROFILE_BUCKETS - 1) {
+        x >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static profile_buffer *profile_thread_buffer(void) {
+    if (profile_local == NULL) {
+        profile_buffer *b = calloc(1, sizeof(profile_buffer));
+        if (b == NULL) {
+            return NULL;
+        }
+        b->next = atomic_load(&profile_buffers);
+        while (!atomic_compare_exchange_weak(&profile_buffers, &b->next, b)) { }
+        profile_local = b;
+    }
+    return profile_local;
+}
+
+static void profile_live_add(long long delta) {
+    long long live = atomic_fetch_add_explicit(&profile_live, delta, memory_order_relaxed) + delta;
+    long long peak = atomic_load_explicit(&profile_peak, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak_explicit(&profile_peak, &peak, live,
+                                                  memory_order_relaxed, memory_order_relaxed)) { }
+}
+
+// Fibonacci hashing, the low 4 bits of a malloc address are always 0.
+static size_t profile_block_slot(const void *ptr) {
+    return (size_t)((((uint64_t)(uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL) >> (64 - PROFILE_BLOCKS_LOG2));
+}
+
+// Size and time are written after the compare-and-swap: no other thread
+// can look for ptr before malloc has returned it.
+static int profile_block_put(const void *ptr, size_t size, uint64_t time_ns) {
+    size_t mask = ((size_t)1 << PROFILE_BLOCKS_LOG2) - 1;
+    size_t slot = profile_block_slot(ptr);
+    for (size_t i = 0; i < PROFILE_PROBES; i++) {
+        profile_block *block = &profile_blocks[(slot + i) & mask];
+        uintptr_t old = atomic_load_explicit(&block->ptr, memory_order_relaxed);
+        while (old == 0 || old == PROFILE_REMOVED) {
+            if (atomic_compare_exchange_weak_explicit(&block->ptr, &old, (uintptr_t)ptr,
+                                                      memory_order_acquire, memory_order_relaxed)) {
+                block->size = size;
+                block->time_ns = time_ns;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// Removes ptr from the table. The release pairs with the acquire of the
+// next put of the slot, which overwrites size and time after our reads.
+static int profile_block_take(const void *ptr, size_t *size, uint64_t *time_ns) {
+    size_t mask = ((size_t)1 << PROFILE_BLOCKS_LOG2) - 1;
+    size_t slot = profile_block_slot(ptr);
+    for (size_t i = 0; i < PROFILE_PROBES; i++) {
+        profile_block *block = &profile_blocks[(slot + i) & mask];
+        uintptr_t old = atomic_load_explicit(&block->ptr, memory_order_relaxed);
+        if (old == 0) {
+            return -1;
+        }
+        if (old == (uintptr_t)ptr) {
+            *size = block->size;
+            *time_ns = block->time_ns;
+            atomic_store_explicit(&block->ptr, PROFILE_REMOVED, memory_order_release);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Open addressing on the address of the file name and the line.
+static profile_site *profile_site_get(profile_buffer *b, const char *file, int line) {
+    size_t slot = ((uintptr_t)file * 31 + (size_t)line) % PROFILE_SITES;
+    for (size_t i = 0; i < PROFILE_SITES; i++) {
+        profile_site *site = &b->sites[(slot + i) % PROFILE_SITES];
+        if (site->file == NULL) {
+            site->file = file;
+            site->line = line;
+        }
+        if (site->file == file && site->line == line) {
+            return site;
+        }
+    }
+    return NULL;
+}
+
+// The functions below are called only while enabled.
+static void profile_record_alloc(void *ptr, size_t size, const char *file, int line) {
+    profile_buffer *b = profile_thread_buffer();
+    if (b == NULL) {
+        return;
+    }
+    profile_site *site = profile_site_get(b, file, line);
+    if (site != NULL) {
+        site->allocs++;
+        site->bytes += size;
+    } else {
+        b->other_allocs++;
+    }
+    b->sizes[profile_log2(size)]++;
+    if (profile_block_put(ptr, size, profile_now()) == 0) {
+        profile_live_add((long long)size);
+    } else {
+        b->untracked++;
+    }
+}
+
+static void profile_record_lifetime(size_t size, uint64_t time_ns) {
+    profile_buffer *b = profile_thread_buffer();
+    if (b == NULL) {
+        return;
+    }
+    profile_live_add(-(long long)size);
+    b->lifetimes[profile_log2(profile_now() - time_ns)]++;
+}
+
+static void profile_record_free(void *ptr, const char *file, int line) {
+    profile_buffer *b = profile_thread_buffer();
+    if (b == NULL) {
+        return;
+    }
+    profile_site *site = profile_site_get(b, file, line);
+    if (site != NULL) {
+        site->frees++;
+    } else {
+        b->other_frees++;
+    }
+    size_t size;
+    uint64_t time_ns;
+    if (profile_block_take(ptr, &size, &time_ns) == 0) {
+        profile_record_lifetime(size, time_ns);
+    }
+}
+
+void *profile_malloc(size_t size, const char *file, int line) {
+    void *ptr = malloc(size);
+    if (ptr != NULL && atomic_load_explicit(&alloc_profile_enabled, memory_order_relaxed)) {
+        profile_record_alloc(ptr, size, file, line);
+    }
+    return ptr;
+}
+
+// calloc has already checked n * size for overflow if it succeeds.
+void *profile_calloc(size_t n, size_t size, const char *file, int line) {
+    void *ptr = calloc(n, size);
+    if (ptr != NULL && atomic_load_explicit(&alloc_profile_enabled, memory_order_relaxed)) {
+        profile_record_alloc(ptr, n * size, file, line);
+    }
+    return ptr;
+}
+
+// The block leaves the table before free: once freed, its
+// address can be returned by malloc to another thread.
+void profile_free(void *ptr, const char *file, int line) {
+    if (ptr != NULL && atomic_load_explicit(&alloc_profile_enabled, memory_order_relaxed)) {
+        profile_record_free(ptr, file, line);
+    }
+    free(ptr);
+}
+
+// A realloc is recorded as the end of the lifetime of the old block
+// and the allocation of the new one. If realloc fails, the old block
+// is still live and goes back to the table.
+void *profile_realloc(void *ptr, size_t size, const char *file, int line) {
+    if (ptr == NULL) {
+        return profile_malloc(size, file, line);
+    }
+    if (!atomic_load_explicit(&alloc_profile_enabled, memory_order_relaxed)) {
+        return realloc(ptr, size);
+    }
+    size_t old_size;
+    uint64_t old_time;
+    int tracked = profile_block_take(ptr, &old_size, &old_time) == 0;
+    void *moved = realloc(ptr, size);
+    if (moved == NULL && size != 0) {
+        if (tracked && profile_block_put(ptr, old_size, old_time) != 0) {
+            profile_live_add(-(long long)old_size);
+        }
+        return NULL;
+    }
+    if (tracked) {
+        profile_record_lifetime(old_size, old_time);
+    }
+    if (moved != NULL) {
+        profile_record_alloc(moved, size, file, line);
+    }
+    return moved;
+}
+
+static int profile_site_cmp(const void *a, const void *b) {
+    const profile_site *x = a, *y = b;
+    size_t events_x = x->allocs + x->frees, events_y = y->allocs + y->frees;
+    return events_x < events_y ? 1 : events_x > events_y ? -1 : 0;
+}
+
+void alloc_profile_report(void) {
+    static profile_site sites[PROFILE_SITES];
+    size_t n_sites = 0, allocs = 0, frees = 0, other_allocs = 0, other_frees = 0, untracked = 0;
+    size_t sizes[PROFILE_BUCKETS] = { 0 }, lifetimes[PROFILE_BUCKETS] = { 0 };
+
+    // Merge the thread buffers by call site.
+    for (profile_buffer *b = atomic_load(&profile_buffers); b != NULL; b = b->next) {
+        for (size_t i = 0; i < PROFILE_SITES; i++) {
+            profile_site *site = &b->sites[i];
+            if (site->file == NULL) {
+                continue;
+            }
+            allocs += site->allocs;
+            frees += site->frees;
+            size_t j = 0;
+            while (j < n_sites && (sites[j].file != site->file || sites[j].line != site->line)) {
+                j++;
+            }
+            if (j == n_sites) {
+                if (n_sites == PROFILE_SITES) {
+                    other_allocs += site->allocs;
+                    other_frees += site->frees;
+                    continue;
+                }
+                sites[n_sites++] = (profile_site){ .file = site->file, .line = site->line };
+            }
+            sites[j].allocs += site->allocs;
+            sites[j].frees += site->frees;
+            sites[j].bytes += site->bytes;
+        }
+        allocs += b->other_allocs;
+        frees += b->other_frees;
+        other_allocs += b->other_allocs;
+        other_frees += b->other_frees;
+        untracked += b->untracked;
+        for (int i = 0; i < PROFILE_BUCKETS; i++) {
+            sizes[i] += b->sizes[i];
+            lifetimes[i] += b->lifetimes[i];
+        }
+    }
+    qsort(sites, n_sites, sizeof(profile_site), profile_site_cmp);
+
+    fprintf(stderr, "allocation profile: %zu allocations, %zu frees, %lld bytes live, %lld bytes peak\n",
+            allocs, frees, atomic_load(&profile_live), atomic_load(&profile_peak));
+    if (untracked > 0) {
+        fprintf(stderr, "%zu blocks untracked (table full), missing from live bytes and lifetimes\n",
+                untracked);
+    }
+    fprintf(stderr, "%12s %12s %14s  %s\n", "allocations", "frees", "bytes", "call site");
+    for (size_t i = 0; i < n_sites && i < PROFILE_TOP_SITES; i++) {
+        fprintf(stderr, "%12zu %12zu %14zu  %s:%d\n",
+                sites[i].allocs, sites[i].frees, sites[i].bytes, sites[i].file, sites[i].line);
+    }
+    if (other_allocs > 0 || other_frees > 0) {
+        fprintf(stderr, "%12zu %12zu %14s  (other sites)\n", other_allocs, other_frees, "-");
+    }
+    fprintf(stderr, "%12s %14s\n", "size <", "allocations");
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        if (sizes[i] > 0) {
+            fprintf(stderr, "%12llu %14zu\n", 2ULL << i, sizes[i]);
+        }
+    }
+    fprintf(stderr, "%12s %14s\n", "lifetime ns <", "frees");
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        if (lifetimes[i] > 0) {
+            fprintf(stderr, "%12llu %14zu\n", 2ULL << i, lifetimes[i]);
+        }
+    }
+}
+
+void alloc_profile_enable(int enable) {
+    static atomic_int report_registered = 0;
+    if (enable && atomic_exchange(&report_registered, 1) == 0) {
+        atexit(alloc_profile_report);
+    }
+    atomic_store(&alloc_profile_enabled, enable);
+}
+
+/*
+ * Cost of the profiler while disabled: n allocations of 16 to 256 bytes (e.g. 10^7)
+ * with malloc and free, and with what the -DALLOC_PROFILE macros expand to, keeping
+ * the last 64 blocks alive like a program holding a few objects at a time. Each run
+ * is repeated and the fastest one is kept, to filter out the noise of other
+ * processes. The only difference is the test of the flag before each call.
+ */
+
+#define PROFILE_BENCH_LIVE 64
+#define PROFILE_BENCH_ON \
+    __builtin_expect(atomic_load_explicit(&alloc_profile_enabled, memory_order_relaxed), 0)
+
+static double profile_bench_run(size_t n, int wrapped) {
+    static void *live[PROFILE_BENCH_LIVE];
+    double start = alloc_seconds();
+    for (size_t i = 0; i < n; i++) {
+        size_t slot = i % PROFILE_BENCH_LIVE;
+        size_t size = 16 + (i * 7919) % 241;
+        if (wrapped) {
+            PROFILE_BENCH_ON ? profile_free(live[slot], __FILE__, __LINE__) : free(live[slot]);
+            live[slot] = PROFILE_BENCH_ON ? profile_malloc(size, __FILE__, __LINE__) : malloc(size);
+        } else {
+            free(live[slot]);
+            live[slot] = malloc(size);
+        }
+        if (live[slot] != NULL) {
+            *(char *)live[slot] = (char)i;
+        }
+    }
+    double secs = alloc_seconds() - start;
+    for (size_t i = 0; i < PROFILE_BENCH_LIVE; i++) {
+        free(live[i]);
+        live[i] = NULL;
+    }
+    return secs;
+}
+
+void alloc_profile_benchmark(size_t n) {
+    if (atomic_load(&alloc_profile_enabled)) {
+        fputs("alloc profile benchmark: profiling must be disabled\n", stderr);
+        return;
+    }
+    double plain = 1e9;
+    double wrapped = 1e9;
+    // Alternate which one runs first, the second run of
+    // a pair finds the heap warmed up by the first one.
+    for (int r = 0; r < 6; r++) {
+        double secs = profile_bench_run(n, r % 2);
+        double other = profile_bench_run(n, !(r % 2));
+        double with = r % 2 ? secs : other;
+        double without = r % 2 ? other : secs;
+        plain = without < plain ? without : plain;
+        wrapped = with < wrapped ? with : wrapped;
+    }
+    printf("%zu allocations, malloc/free: %.1f ns/op, disabled profiler: %.1f ns/op (%+.1f%%)\n",
+           n, plain * 1e9 / n, wrapped * 1e9 / n, (wrapped / plain - 1) * 100);
+}
+
+///////////////////////// SCRATCH BUFFERS /////////////////////////
+
+/*
+ * A VLA (see variable_length_arrays in 08_dyn_alloc.c) is the fastest temporary
+ * buffer, but a big size silently overflows the stack and crashes the program. A
+ * scratch buffer keeps the fast path for small sizes and stays safe for big ones:
+ * the scratch struct, declared as a local variable, contains an inline buffer of
+ * SCRATCH_INLINE_SIZE bytes used when the request fits. Bigger requests use a heap
+ * buffer owned by the thread and reused by all the following requests, so after the
+ * first big request they don't call malloc either. The thread buffer is freed when
+ * the thread exits.
+ *
+ * If the thread buffer is already in use (a nested scratch buffer) or the request is
+ * bigger than SCRATCH_MAX_RETAINED (we don't want to keep huge buffers around), the
+ * memory comes from malloc and is freed on release.
+ */
+
+#define SCRATCH_INLINE_SIZE 1024
+#define SCRATCH_MAX_RETAINED ((size_t)16 << 20)
+
+typedef struct {
+    void *ptr;
+    int source;     // 0 inline, 1 thread buffer, 2 malloc
+    alignas(max_align_t) unsigned char inline_buf[SCRATCH_INLINE_SIZE];
+} scratch;
+
+static _Thread_local void *scratch_thread_buf = NULL;
+static _Thread_local size_t scratch_thread_size = 0;
+static _Thread_local int scratch_thread_busy = 0;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+
+static void scratch_key_create(void) {
+    pthread_key_create(&scratch_key, free);
+}
+
+// Returns a buffer of at least size bytes, aligned as max_align_t,
+// valid until scratch_release. Returns a null pointer on failure.
+void *scratch_get(scratch *s, size_t size) {
+    if (size <= SCRATCH_INLINE_SIZE) {
+        s->ptr = s->inline_buf;
+        s->source = 0;
+        return s->ptr;
+    }
+    if (!scratch_thread_busy && size <= SCRATCH_MAX_RETAINED) {
+        if (size > scratch_thread_size) {
+            pthread_once(&scratch_key_once, scratch_key_create);
+            // The old content isn't needed, so free + malloc avoids
+            // the copy that realloc would do.
+            free(scratch_thread_buf);
+            scratch_thread_buf = malloc(size);
+            scratch_thread_size = scratch_thread_buf == NULL ? 0 : size;
+            pthread_setspecific(scratch_key, scratch_thread_buf);
+        }
+        if (scratch_thread_buf != NULL) {
+            scratch_thread_busy = 1;
+            s->ptr = scratch_thread_buf;
+            s->source = 1;
+            return s->ptr;
+        }
+    }
+    s->ptr = malloc(size);
+    s->source = 2;
+    return s->ptr;
+}
+
+void scratch_release(scratch *s) {
+    if (s->source == 1) {
+        scratch_thread_busy = 0;
+    } else if (s->source == 2) {
+        free(s->ptr);
+    }
+    s->ptr = NULL;
+    s->source = 0;
+}
+
+// Same as variable_length_arrays in 08_dyn_alloc.c,
+// but safe for any size.
+void scratch_usage(unsigned int size) {
+    scratch s;
+    int *arr = scratch_get(&s, sizeof(int) * (size_t)size);
+    if (arr == NULL) {
+        return;
+    }
+    for (unsigned int i = 0; i < size; i++) {
+        arr[i] = 13;
+    }
+    scratch_release(&s);
+}
+
+///////////////////////// ALIGNED ALLOCATION /////////////////////////
+
+/*
+ * malloc returns memory aligned for any standard type (the alignment of max_align_t,
+ * usually 16 bytes), see alignof_operator in 07_expr_ops.c. Some uses need more:
+ * aligned SIMD loads and stores need 32 or 64 bytes, and data written by different
+ * threads should start on different cache lines (64 bytes on most CPUs). When two
+ * threads write different variables in the same cache line, the line bounces between
+ * their cores as if they shared the data (false sharing).
+ *
+ * C11 has aligned_alloc, but there's no aligned realloc or calloc: realloc may return
+ * memory with only the default alignment. These functions allocate size + align bytes
+ * with malloc, return the first aligned address after a small header, and store in
+ * the header the pointer returned by malloc (to free it) and the offset of the
+ * aligned address. After a realloc the aligned address may have a different offset
+ * in the new block, so the data is moved to the right place.
+ */
+
+typedef struct {
+    size_t offset;
+    size_t size;
+} aligned_header;
+
+// Offset of the first aligned address after the header.
+static size_t aligned_offset(unsigned char *raw, size_t align) {
+    uintptr_t first = (uintptr_t)raw + sizeof(aligned_header);
+    return ((first + align - 1) & ~(uintptr_t)(align - 1)) - (uintptr_t)raw;
+}
+
+static void *aligned_place(unsigned char *raw, size_t offset, size_t size) {
+    aligned_header h = { .offset = offset, .size = size };
+    memcpy(raw + offset - sizeof(aligned_header), &h, sizeof(h));
+    return raw + offset;
+}
+
+static aligned_header aligned_header_of(void *ptr) {
+    aligned_header h;
+    memcpy(&h, (unsigned char *)ptr - sizeof(aligned_header), sizeof(h));
+    return h;
+}
+
+// align must be a power of two.
+void *aligned_malloc(size_t align, size_t size) {
+    if (align < alignof(max_align_t)) {
+        align = alignof(max_align_t);
+    }
+    if (size > SIZE_MAX - align - sizeof(aligned_header)) {
+        return NULL;
+    }
+    unsigned char *raw = malloc(size + align + sizeof(aligned_header));
+    return raw == NULL ? NULL : aligned_place(raw, aligned_offset(raw, align), size);
+}
+
+void *aligned_calloc(size_t align, size_t n, size_t size) {
+    if (size != 0 && n > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *ptr = aligned_malloc(align, n * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, n * size);
+    }
+    return ptr;
+}
+
+void aligned_free(void *ptr) {
+    if (ptr != NULL) {
+        free((unsigned char *)ptr - aligned_header_of(ptr).offset);
+    }
+}
+
+// Like realloc, keeping the alignment, which must be the same
+// used to allocate ptr. On failure ptr is left untouched.
+void *aligned_realloc(void *ptr, size_t align, size_t size) {
+    if (ptr == NULL) {
+        return aligned_malloc(align, size);
+    }
+    if (align < alignof(max_align_t)) {
+        align = alignof(max_align_t);
+    }
+    if (size > SIZE_MAX - align - sizeof(aligned_header)) {
+        return NULL;
+    }
+    aligned_header old = aligned_header_of(ptr);
+    unsigned char *raw = realloc((unsigned char *)ptr - old.offset, size + align + sizeof(aligned_header));
+    if (raw == NULL) {
+        return NULL;
+    }
+    // Move the data before writing the header, which may
+    // overlap the data at the old offset.
+    size_t offset = aligned_offset(raw, align);
+    if (offset != old.offset) {
+        memmove(raw + offset, raw + old.offset, old.size < size ? old.size : size);
+    }
+    return aligned_place(raw, offset, size);
+}
+
+/*
+ * A variant of the tool structure (08_dyn_alloc.c) whose flexible array member starts
+ * on a cache line: alignas on the member aligns it inside the structure, and the
+ * structure itself is allocated on a 64 bytes boundary, so the data can be processed
+ * with aligned 64 bytes vector loads (e.g. AVX-512).
+ */
+
+#define ALIGNED_CACHE_LINE 64
+
+typedef struct {
+    int num;
+    alignas(ALIGNED_CACHE_LINE) int data[];
+} aligned_tool;
+
+aligned_tool *aligned_tool_new(int array_size) {
+    aligned_tool *t = aligned_malloc(ALIGNED_CACHE_LINE, sizeof(aligned_tool) + sizeof(int) * array_size);
+    if (t != NULL) {
+        t->num = array_size;
+    }
+    return t;
+}
+
+aligned_tool *aligned_tool_resize(aligned_tool *t, int array_size) {
+    aligned_tool *resized = aligned_realloc(t, ALIGNED_CACHE_LINE, sizeof(aligned_tool) + sizeof(int) * array_size);
+    if (resized != NULL) {
+        resized->num = array_size;
+    }
+    return resized;
+}
+
+void aligned_tool_delete(aligned_tool *t) {
+    aligned_free(t);
+}
+
+/*
+ * Per-thread data padded to a cache line: each counter is aligned to 64 bytes, so
+ * sizeof(padded_counter) is 64 and the counters of different threads never share
+ * a line. The array must be allocated with the same alignment.
+ */
+
+typedef struct {
+    alignas(ALIGNED_CACHE_LINE) long long value;
+} padded_counter;
+
+padded_counter *padded_counters_new(size_t threads) {
+    return aligned_calloc(alignof(padded_counter), threads, sizeof(padded_counter));
+}
+
+void aligned_usage(void) {
+    aligned_tool *t = aligned_tool_new(10);
+    if (t == NULL) {
+        return;
+    }
+    printf("data at %p, aligned to 64: %s\n", (void *)t->data,
+           (uintptr_t)t->data % 64 == 0 ? "yes" : "no");
+
+    aligned_tool *grown = aligned_tool_resize(t, 100000);
+    if (grown != NULL) {
+        t = grown;
+    }
+    printf("data at %p, aligned to 64: %s\n", (void *)t->data,
+           (uintptr_t)t->data % 64 == 0 ? "yes" : "no");
+    aligned_tool_delete(t);
+
+    padded_counter *counters = padded_counters_new(8);
+    printf("sizeof(padded_counter) = %zu\n", sizeof(padded_counter)); // -> 64
+    aligned_free(counters);
+}
+
+///////////////////////// HUGE PAGE ARENA /////////////////////////
+
+/*
+ * Virtual addresses are translated to physical ones through the page tables, and the
+ * TLB caches the recent translations. With 4 KB pages a TLB of some thousands entries
+ * covers only a few MB, so random accesses over a big array miss the TLB almost every
+ * time and pay a page table walk. Huge pages (2 MB on x86-64) cover 512 times more
+ * memory per entry. Linux offers them in two ways:
+ *
+ * - transparent huge pages (THP): madvise(MADV_HUGEPAGE) on a 2 MB aligned region asks
+ *   the kernel to back it with huge pages when possible, falling back to normal pages
+ * - hugetlb: mmap with MAP_HUGETLB takes pages from a pool reserved by the administrator
+ *   (/proc/sys/vm/nr_hugepages) and fails if the pool is too small
+ *
+ * This arena reserves a big range of addresses with an anonymous mmap without access
+ * rights (it costs no memory), and makes it accessible with mprotect in 2 MB steps as
+ * the arena grows. Physical pages are allocated by the kernel on first touch. On reset,
+ * madvise(MADV_DONTNEED) gives the memory back to the system while keeping the range.
+ */
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+enum huge_mode {
+    HUGE_NONE,          // normal pages
+    HUGE_TRANSPARENT,   // THP with madvise
+    HUGE_EXPLICIT,      // hugetlb, falling back to THP
+};
+
+typedef struct {
+    unsigned char *base;
+    size_t reserved;
+    size_t committed;
+    size_t used;
+    enum huge_mode mode;
+} huge_arena;
+
+// Reserve a range of addresses aligned to a huge page,
+// by reserving one more huge page and trimming the ends.
+static unsigned char *huge_reserve(size_t size) {
+    size_t len = size + HUGE_PAGE_SIZE;
+    unsigned char *raw = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    unsigned char *base = (unsigned char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (base > raw) {
+        munmap(raw, base - raw);
+    }
+    if (raw + len > base + size) {
+        munmap(base + size, raw + len - (base + size));
+    }
+    return base;
+}
+
+// Returns 0 on success, -1 on failure. The reserved size
+// is rounded up to a multiple of the huge page size.
+int huge_arena_init(huge_arena *a, size_t reserve, enum huge_mode mode) {
+    reserve = (reserve + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    a->base = NULL;
+    a->reserved = reserve;
+    a->committed = 0;
+    a->used = 0;
+    a->mode = mode;
+
+#ifdef MAP_HUGETLB
+    if (mode == HUGE_EXPLICIT) {
+        // Without MAP_NORESERVE the huge pages are reserved from the pool
+        // now, so mmap fails (instead of a SIGBUS on first touch) if the
+        // pool is too small.
+        void *base = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            a->base = base;
+            return 0;
+        }
+        a->mode = HUGE_TRANSPARENT;
+    }
+#else
+    if (mode == HUGE_EXPLICIT) {
+        a->mode = HUGE_TRANSPARENT;
+    }
+#endif
+
+    a->base = huge_reserve(reserve);
+    if (a->base == NULL) {
+        return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    if (a->mode == HUGE_TRANSPARENT) {
+        // Only a hint: if it fails we get normal pages.
+        madvise(a->base, reserve, MADV_HUGEPAGE);
+    }
+#endif
+#ifdef MADV_NOHUGEPAGE
+    if (a->mode == HUGE_NONE) {
+        // With THP set to "always" the kernel would use huge pages anyway.
+        madvise(a->base, reserve, MADV_NOHUGEPAGE);
+    }
+#endif
+    return 0;
+}
+
+void *huge_arena_alloc(huge_arena *a, size_t size, size_t align) {
+    uintptr_t base = (uintptr_t)a->base;
+    size_t offset = ((base + a->used + align - 1) & ~(uintptr_t)(align - 1)) - base;
+    if (offset > a->reserved || size > a->reserved - offset) {
+        return NULL;
+    }
+    size_t end = offset + size;
+    if (end > a->committed) {
+        size_t commit = (end + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if (mprotect(a->base + a->committed, commit - a->committed, PROT_READ | PROT_WRITE) == -1) {
+            return NULL;
+        }
+        a->committed = commit;
+    }
+    a->used = end;
+    return a->base + offset;
+}
+
+// Release all the objects and give the memory back to the system. The
+// pages are zero-filled on the next touch. Returns 0 on success, -1 if
+// the memory could not be released: MADV_DONTNEED fails with EINVAL on
+// MAP_HUGETLB ranges before Linux 5.18. The objects are released anyway
+// and the pages stay committed with their old contents, so the arena is
+// still usable but the memory is not zeroed.
+int huge_arena_reset(huge_arena *a) {
+    a->used = 0;
+    if (a->committed > 0 && madvise(a->base, a->committed, MADV_DONTNEED) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+void huge_arena_destroy(huge_arena *a) {
+    if (a->base != NULL) {
+        munmap(a->base, a->reserved);
+    }
+    a->base = NULL;
+}
+
+/*
+ * Random reads over a big array (e.g. 4 GB) with normal pages and with huge pages.
+ * AnonHugePages in /proc/self/smaps_rollup tells how much memory the kernel backed
+ * with transparent huge pages.
+ */
+
+static size_t anon_huge_pages_kb(void) {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+void huge_pages_benchmark(size_t bytes) {
+    const enum huge_mode modes[] = { HUGE_NONE, HUGE_TRANSPARENT, HUGE_EXPLICIT };
+    const char *names[] = { "normal pages", "transparent huge", "hugetlb" };
+    const size_t reads = 50 * 1000 * 1000;
+    if (bytes < sizeof(uint64_t)) {
+        fprintf(stderr, "huge pages benchmark: at least %zu bytes needed\n", sizeof(uint64_t));
+        return;
+    }
+
+    for (int m = 0; m < 3; m++) {
+        huge_arena a;
+        if (huge_arena_init(&a, bytes, modes[m]) == -1) {
+            perror("reserving memory");
+            continue;
+        }
+        size_t n = bytes / sizeof(uint64_t);
+        uint64_t *arr = huge_arena_alloc(&a, n * sizeof(uint64_t), alignof(uint64_t));
+        if (arr == NULL) {
+            fprintf(stderr, "%s: cannot commit memory\n", names[m]);
+            huge_arena_destroy(&a);
+            continue;
+        }
+        for (size_t i = 0; i < n; i++) {
+            arr[i] = i;
+        }
+
+        // xorshift random indexes, each read depends on the previous
+        // one so the CPU can't overlap the misses.
+        uint64_t x = 88172645463325252ULL, sum = 0;
+        double start = alloc_seconds();
+        for (size_t i = 0; i < reads; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            sum += arr[(x + sum) % n];
+        }
+        double secs = alloc_seconds() - start;
+        printf("%17s: %6.1f ns/read, AnonHugePages %zu kB (sum %llu)\n", names[a.mode],
+               secs * 1e9 / reads, anon_huge_pages_kb(), (unsigned long long)sum);
+        if (huge_arena_reset(&a) == -1) {
+            perror("releasing huge pages");
+        }
+        huge_arena_destroy(&a);
+    }
+}
\ No newline at end of file